@@ -0,0 +1,257 @@
+/*
+ * Copyright 2016 James Geboski <jgeboski@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <g710p.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+
+#define SAMPLES_DEFAULT  1000
+#define BATCH  256
+
+
+typedef struct bench bench_t;
+
+
+struct bench
+{
+    const char *path;
+    unsigned int samples;
+    uint64_t *times;
+};
+
+
+static int
+uint64_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+static uint64_t
+percentile(const uint64_t *times, unsigned int n, unsigned int permille)
+{
+    return times[((uint64_t) (n - 1) * permille) / 1000];
+}
+
+/* Prints the results as a single line of key=value pairs, with the
+ * latencies in nanoseconds per operation.
+ */
+static void
+bench_print(bench_t *bench, const char *name, unsigned int batch)
+{
+    double mean;
+    uint64_t total = 0;
+    unsigned int i;
+    unsigned int n = bench->samples;
+
+    qsort(bench->times, n, sizeof *bench->times, uint64_cmp);
+
+    for (i = 0; i < n; i++) {
+        total += bench->times[i];
+    }
+
+    mean = (double) total / n;
+
+    printf("bench=%s samples=%u batch=%u mean_ns=%.1f p50_ns=%lu "
+           "p90_ns=%lu p99_ns=%lu p999_ns=%lu max_ns=%lu ops_per_sec=%.0f\n",
+           name, n, batch, mean,
+           (unsigned long) percentile(bench->times, n, 500),
+           (unsigned long) percentile(bench->times, n, 900),
+           (unsigned long) percentile(bench->times, n, 990),
+           (unsigned long) percentile(bench->times, n, 999),
+           (unsigned long) bench->times[n - 1],
+           (mean > 0) ? (1e9 / mean) : 0);
+}
+
+static void
+bench_decode(bench_t *bench, const char *name, const uint8_t *data,
+             size_t size)
+{
+    g710p_device_t *dev;
+    g710p_report_t report;
+    uint64_t start;
+    unsigned int i;
+    unsigned int j;
+
+    dev = g710p_mock_open();
+    g710p_mock_report_add(dev, data, size);
+    g710p_mock_set_repeat(dev, 1);
+
+    for (i = 0; i < bench->samples; i++) {
+        start = g710p_time_ns();
+
+        for (j = 0; j < BATCH; j++) {
+            if (!g710p_report_get(dev, &report, 0)) {
+                fprintf(stderr, "error: Failed to decode %s\n", name);
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        bench->times[i] = (g710p_time_ns() - start) / BATCH;
+    }
+
+    g710p_close(dev);
+    bench_print(bench, name, BATCH);
+}
+
+static void
+bench_feature(bench_t *bench, g710p_device_t *dev, const char *name)
+{
+    uint64_t start;
+    unsigned int i;
+
+    for (i = 0; i < bench->samples; i++) {
+        start = g710p_time_ns();
+
+        /* The refresh reads both feature reports back from the device */
+        if (!g710p_backlight_set_levels(dev, i % 5, 4 - (i % 5)) ||
+            !g710p_mkeys_set_leds(dev, i & G710P_KEY_MASK_M) ||
+            !g710p_refresh(dev))
+        {
+            fprintf(stderr, "error: Failed the feature round trip\n");
+            exit(EXIT_FAILURE);
+        }
+
+        bench->times[i] = g710p_time_ns() - start;
+    }
+
+    bench_print(bench, name, 1);
+}
+
+static void
+bench_list(bench_t *bench)
+{
+    char **devlist;
+    uint64_t start;
+    unsigned int i;
+
+    for (i = 0; i < bench->samples; i++) {
+        start = g710p_time_ns();
+        devlist = g710p_device_list_get();
+        g710p_device_list_free(devlist);
+        bench->times[i] = g710p_time_ns() - start;
+    }
+
+    bench_print(bench, "list", 1);
+}
+
+static void
+bench_open(bench_t *bench, const char *path, const char *name)
+{
+    g710p_device_t *dev;
+    uint64_t start;
+    unsigned int i;
+
+    for (i = 0; i < bench->samples; i++) {
+        start = g710p_time_ns();
+        dev = (path != NULL) ? g710p_open(path) : g710p_mock_open();
+
+        if (dev == NULL) {
+            fprintf(stderr, "error: Failed to open %s\n", path);
+            exit(EXIT_FAILURE);
+        }
+
+        g710p_close(dev);
+        bench->times[i] = g710p_time_ns() - start;
+    }
+
+    bench_print(bench, name, 1);
+}
+
+static void
+usage(const char *name)
+{
+    printf("Usage: %s [-s SAMPLES] [-p PATH]\n", name);
+    printf("\n");
+    printf("  -s SAMPLES  The number of samples of each benchmark\n");
+    printf("  -p PATH     Also benchmark a hidraw device, such as one\n");
+    printf("              created by g710p-virtual\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    bench_t bench = {NULL, SAMPLES_DEFAULT, NULL};
+    g710p_device_t *dev;
+    int opt;
+
+    static const uint8_t media[] = {G710P_REPORT_MEDIA_KEYS, 0x01};
+    static const uint8_t gkeys[] = {G710P_REPORT_G_KEYS, 0x01, 0x10, 0x00};
+    static const uint8_t cntrl[] = {G710P_REPORT_CNTRL_KEYS, 0x00, 0x02,
+                                    0x03, 0x00, 0x00, 0x00, 0x00};
+
+    while ((opt = getopt(argc, argv, "hs:p:")) != -1) {
+        switch (opt) {
+        case 's':
+            bench.samples = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'p':
+            bench.path = optarg;
+            break;
+
+        default:
+            usage(argv[0]);
+            return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (bench.samples == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (!g710p_init()) {
+        fprintf(stderr, "error: Failed to initialize libg710p\n");
+        return EXIT_FAILURE;
+    }
+
+    bench.times = malloc((sizeof *bench.times) * bench.samples);
+    assert(bench.times != NULL);
+
+    bench_decode(&bench, "decode_media", media, sizeof media);
+    bench_decode(&bench, "decode_g", gkeys, sizeof gkeys);
+    bench_decode(&bench, "decode_cntrl", cntrl, sizeof cntrl);
+
+    dev = g710p_mock_open();
+    bench_feature(&bench, dev, "feature_mock");
+    g710p_close(dev);
+
+    bench_list(&bench);
+    bench_open(&bench, NULL, "open_mock");
+
+    if (bench.path != NULL) {
+        dev = g710p_open(bench.path);
+
+        if (dev == NULL) {
+            return EXIT_FAILURE;
+        }
+
+        bench_feature(&bench, dev, "feature_device");
+        g710p_close(dev);
+        bench_open(&bench, bench.path, "open_device");
+    }
+
+    free(bench.times);
+    g710p_exit();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright 2016 James Geboski <jgeboski@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <hidapi.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "g710p-private.h"
+
+/** Device handle of the hidapi backend. */
+typedef struct g710p_hidapi g710p_hidapi_t;
+
+
+/**
+ * Device handle of the hidapi backend. With hidraw, hidapi does not
+ * expose its file descriptor, so input reports are read from a second
+ * descriptor of the hidraw device, which can then be polled. The kernel
+ * queues each report for every descriptor, and the reports queued for
+ * the hidapi descriptor are simply dropped once its queue is full.
+ */
+struct g710p_hidapi
+{
+    hid_device *dev;  /**< The \c hid_device. */
+    int fd;  /**< The hidraw input file descriptor, or \c -1. */
+};
+
+
+static int
+g710p_hidapi_init(void)
+{
+    return hid_init() == 0;
+}
+
+static int
+g710p_hidapi_exit(void)
+{
+    return hid_exit() == 0;
+}
+
+static void *
+g710p_hidapi_open(const char *path)
+{
+    g710p_hidapi_t *hdev;
+    hid_device *dev;
+    int fd = -1;
+
+    dev = hid_open_path(path);
+
+    if (dev == NULL) {
+        return NULL;
+    }
+
+#ifdef G710P_HIDAPI_HIDRAW
+    fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+    if (fd == -1) {
+        hid_close(dev);
+        return NULL;
+    }
+#endif /* G710P_HIDAPI_HIDRAW */
+
+    hdev = malloc(sizeof *hdev);
+    assert(hdev != NULL);
+    hdev->dev = dev;
+    hdev->fd = fd;
+    return hdev;
+}
+
+static void
+g710p_hidapi_close(void *handle)
+{
+    g710p_hidapi_t *hdev = handle;
+
+    if (hdev->fd != -1) {
+        close(hdev->fd);
+    }
+
+    hid_close(hdev->dev);
+    free(hdev);
+}
+
+static int
+g710p_hidapi_fd(void *handle)
+{
+    g710p_hidapi_t *hdev = handle;
+
+    return hdev->fd;
+}
+
+static const wchar_t *
+g710p_hidapi_error(void *handle)
+{
+    g710p_hidapi_t *hdev = handle;
+
+    return hid_error(hdev->dev);
+}
+
+static int
+g710p_hidapi_read(void *handle, uint8_t *data, size_t size, int timeout)
+{
+    g710p_hidapi_t *hdev = handle;
+
+    if (hdev->fd != -1) {
+        return g710p_fd_read(hdev->fd, data, size, timeout);
+    }
+
+    return hid_read_timeout(hdev->dev, data, size, timeout);
+}
+
+static int
+g710p_hidapi_get_feature(void *handle, uint8_t *data, size_t size)
+{
+    g710p_hidapi_t *hdev = handle;
+
+    return hid_get_feature_report(hdev->dev, data, size);
+}
+
+static int
+g710p_hidapi_send_feature(void *handle, const uint8_t *data, size_t size)
+{
+    g710p_hidapi_t *hdev = handle;
+
+    return hid_send_feature_report(hdev->dev, data, size);
+}
+
+/**
+ * The hidapi backend, used by the hidraw flavour.
+ */
+const g710p_backend_t g710p_backend_system = {
+    g710p_hidapi_init,
+    g710p_hidapi_exit,
+    g710p_hidraw_list_get,
+    g710p_hidapi_open,
+    g710p_hidapi_close,
+    g710p_hidapi_fd,
+    g710p_hidapi_error,
+    g710p_hidapi_read,
+    g710p_hidapi_get_feature,
+    g710p_hidapi_send_feature,
+    NULL,
+    NULL,
+    NULL,
+    1
+};
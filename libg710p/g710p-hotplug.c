@@ -0,0 +1,408 @@
+/*
+ * Copyright 2016 James Geboski <jgeboski@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file */
+
+#define _GNU_SOURCE  /* struct ucred */
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "g710p-private.h"
+
+#define G710P_UEVENT_SIZE  8192  /**< The maximum size of a uevent. */
+#define G710P_UEVENT_UDEV  2  /**< The netlink group of udev events. */
+#define G710P_UDEV_PREFIX  "libudev"  /**< The prefix of udev events. */
+#define G710P_UDEV_MAGIC  0xFEEDCAFE  /**< The magic of udev events. */
+
+
+/** Header of a udev netlink event. */
+typedef struct g710p_udev_header g710p_udev_header_t;
+
+
+/**
+ * Internals of #g710p_hotplug.
+ */
+struct g710p_hotplug
+{
+    int fd;  /**< The netlink socket. */
+    g710p_hotplug_func_t func;  /**< The #g710p_hotplug_func_t. */
+    void *data;  /**< The user defined data of the callback. */
+    char **devices;  /**< The \c NULL terminated list of known devices. */
+    size_t count;  /**< The number of known devices. */
+    size_t size;  /**< The allocated size of the known devices. */
+};
+
+/**
+ * Header of a udev netlink event, as sent by udevd. Only the fields
+ * needed to find the properties are used.
+ */
+struct g710p_udev_header
+{
+    char prefix[8];  /**< The #G710P_UDEV_PREFIX. */
+    uint32_t magic;  /**< The #G710P_UDEV_MAGIC, in network order. */
+    uint32_t header_size;  /**< The size of the header. */
+    uint32_t properties_off;  /**< The offset of the properties. */
+    uint32_t properties_len;  /**< The size of the properties. */
+    uint32_t filter_subsystem_hash;  /**< The subsystem filter hash. */
+    uint32_t filter_devtype_hash;  /**< The device type filter hash. */
+    uint32_t filter_tag_bloom_hi;  /**< The high tag bloom filter. */
+    uint32_t filter_tag_bloom_lo;  /**< The low tag bloom filter. */
+};
+
+
+static ssize_t
+g710p_hotplug_find(g710p_hotplug_t *hp, const char *path)
+{
+    size_t i;
+
+    for (i = 0; i < hp->count; i++) {
+        if (strcmp(hp->devices[i], path) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void
+g710p_hotplug_add(g710p_hotplug_t *hp, const char *path)
+{
+    if ((hp->count + 1) >= hp->size) {
+        hp->size = (hp->size != 0) ? (hp->size * 2) : 4;
+        hp->devices = realloc(hp->devices, (sizeof *hp->devices) * hp->size);
+        assert(hp->devices != NULL);
+    }
+
+    hp->devices[hp->count++] = g710p_strdup(path);
+    hp->devices[hp->count] = NULL;
+}
+
+static void
+g710p_hotplug_remove(g710p_hotplug_t *hp, size_t idx)
+{
+    free(hp->devices[idx]);
+    hp->devices[idx] = hp->devices[--hp->count];
+    hp->devices[hp->count] = NULL;
+}
+
+/**
+ * Gets the value of a property of a uevent.
+ *
+ * @param props The \c NUL separated properties.
+ * @param size The size of the properties.
+ * @param key The key of the property, including the \c = separator.
+ * @return The value of the property, or \c NULL if there is none.
+ */
+static const char *
+g710p_uevent_get(const char *props, size_t size, const char *key)
+{
+    const char *end = props + size;
+    size_t len = strlen(key);
+
+    while (props < end) {
+        if (strncmp(props, key, len) == 0) {
+            return props + len;
+        }
+
+        props += strnlen(props, end - props) + 1;
+    }
+
+    return NULL;
+}
+
+/**
+ * Handles a udev event of the netlink socket. The udev events are only
+ * sent once udevd has applied its rules, so the device node is ready
+ * to be opened. Only the hidraw devices are of any interest, where the
+ * added devices are checked via sysfs, and the removed devices are
+ * checked against the known devices.
+ *
+ * @param hp The #g710p_hotplug.
+ * @param buf The uevent.
+ * @param size The size of the uevent.
+ * @return \c 1 if the callback was called, otherwise \c 0.
+ */
+static int
+g710p_hotplug_uevent(g710p_hotplug_t *hp, char *buf, size_t size)
+{
+    char path[64];
+    const char *action;
+    const char *name;
+    const char *props;
+    const char *subsys;
+    g710p_udev_header_t *hdr;
+    size_t psize;
+    ssize_t idx;
+
+    hdr = (g710p_udev_header_t *) buf;
+
+    if ((size < sizeof *hdr) ||
+        (memcmp(hdr->prefix, G710P_UDEV_PREFIX,
+                sizeof G710P_UDEV_PREFIX) != 0) ||
+        (ntohl(hdr->magic) != G710P_UDEV_MAGIC) ||
+        (hdr->properties_off > size) ||
+        (hdr->properties_len > (size - hdr->properties_off)))
+    {
+        return 0;
+    }
+
+    props = buf + hdr->properties_off;
+    psize = hdr->properties_len;
+
+    action = g710p_uevent_get(props, psize, "ACTION=");
+    subsys = g710p_uevent_get(props, psize, "SUBSYSTEM=");
+    name = g710p_uevent_get(props, psize, "DEVNAME=");
+
+    if ((action == NULL) || (subsys == NULL) || (name == NULL) ||
+        (strcmp(subsys, "hidraw") != 0))
+    {
+        return 0;
+    }
+
+    if (strrchr(name, '/') != NULL) {
+        name = strrchr(name, '/') + 1;
+    }
+
+    snprintf(path, sizeof path, "/dev/%s", name);
+    idx = g710p_hotplug_find(hp, path);
+
+    if (strcmp(action, "add") == 0) {
+        if ((idx >= 0) || !g710p_hidraw_supported(name)) {
+            return 0;
+        }
+
+        g710p_hotplug_add(hp, path);
+        hp->func(path, 1, hp->data);
+        return 1;
+    }
+
+    if ((strcmp(action, "remove") == 0) && (idx >= 0)) {
+        g710p_hotplug_remove(hp, idx);
+        hp->func(path, 0, hp->data);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Creates a new #g710p_hotplug, which monitors supported devices being
+ * added and removed. The monitor listens to the udev events of a
+ * netlink socket, so devices are noticed without enumerating every
+ * device again. The current devices are enumerated once, and the list
+ * of known devices is then maintained from the events. Only the hidraw
+ * libraries support monitoring. The returned #g710p_hotplug should be
+ * freed with #g710p_hotplug_free() when no longer needed.
+ *
+ * @param func The #g710p_hotplug_func_t.
+ * @param data The user defined data passed to \p func.
+ * @return The #g710p_hotplug, or \c NULL on error.
+ */
+g710p_hotplug_t *
+g710p_hotplug_new(g710p_hotplug_func_t func, void *data)
+{
+    char **devlist;
+    g710p_hotplug_t *hp;
+    int fd;
+    int on = 1;
+    size_t i;
+    struct sockaddr_nl addr;
+
+    assert(func != NULL);
+
+    if (!g710p_backend_system.hidraw) {
+        g710p_errorln("Hotplug is only supported by the hidraw libraries");
+        return NULL;
+    }
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                NETLINK_KOBJECT_UEVENT);
+
+    if (fd == -1) {
+        g710p_errorln("Failed to create uevent socket: %s", strerror(errno));
+        return NULL;
+    }
+
+    memset(&addr, 0, sizeof addr);
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = G710P_UEVENT_UDEV;
+
+    if ((setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof on) != 0) ||
+        (bind(fd, (struct sockaddr *) &addr, sizeof addr) != 0))
+    {
+        g710p_errorln("Failed to bind uevent socket: %s", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    hp = calloc(1, sizeof *hp);
+    assert(hp != NULL);
+    hp->fd = fd;
+    hp->func = func;
+    hp->data = data;
+    hp->size = 4;
+    hp->devices = malloc((sizeof *hp->devices) * hp->size);
+    assert(hp->devices != NULL);
+    hp->devices[0] = NULL;
+
+    /* Enumerate after binding, so no device can be missed in between.
+     * The sysfs helper is the list of both hidraw libraries, and unlike
+     * g710p_device_list_get(), it does not require g710p_init(). */
+    devlist = g710p_hidraw_list_get();
+
+    for (i = 0; devlist[i] != NULL; i++) {
+        g710p_hotplug_add(hp, devlist[i]);
+    }
+
+    g710p_device_list_free(devlist);
+    return hp;
+}
+
+/**
+ * Frees all of the memory used by a #g710p_hotplug.
+ *
+ * @param hp The #g710p_hotplug.
+ */
+void
+g710p_hotplug_free(g710p_hotplug_t *hp)
+{
+    size_t i;
+
+    assert(hp != NULL);
+
+    for (i = 0; i < hp->count; i++) {
+        free(hp->devices[i]);
+    }
+
+    close(hp->fd);
+    free(hp->devices);
+    free(hp);
+}
+
+/**
+ * Gets the pollable file descriptor of a #g710p_hotplug. The descriptor
+ * becomes readable when there are events to dispatch with
+ * #g710p_hotplug_dispatch(). The descriptor must not be read or closed
+ * by the caller.
+ *
+ * @param hp The #g710p_hotplug.
+ * @return The file descriptor.
+ */
+int
+g710p_hotplug_fd(g710p_hotplug_t *hp)
+{
+    assert(hp != NULL);
+    return hp->fd;
+}
+
+/**
+ * Gets the list of known device paths of a #g710p_hotplug. The list is
+ * maintained by #g710p_hotplug_dispatch(), and is only valid until the
+ * next dispatch. The list must not be modified or freed.
+ *
+ * @param hp The #g710p_hotplug.
+ * @return The \c NULL terminated list of device paths.
+ */
+char **
+g710p_hotplug_devices(g710p_hotplug_t *hp)
+{
+    assert(hp != NULL);
+    return hp->devices;
+}
+
+/**
+ * Dispatches the pending events of a #g710p_hotplug, calling the
+ * callback for every supported device which was added or removed. If
+ * \p timeout is \c -1, this function blocks until there is an event.
+ * If \p timeout is \c 0, the function does not block.
+ *
+ * @param hp The #g710p_hotplug.
+ * @param timeout The timeout in milliseconds.
+ * @return The number of devices added or removed, or \c -1 on error.
+ */
+int
+g710p_hotplug_dispatch(g710p_hotplug_t *hp, int timeout)
+{
+    char buf[G710P_UEVENT_SIZE];
+    char cbuf[CMSG_SPACE(sizeof (struct ucred))];
+    int count = 0;
+    ssize_t res;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    struct msghdr msg;
+    struct pollfd pfd;
+    struct sockaddr_nl addr;
+    struct ucred *cred;
+
+    assert(hp != NULL);
+
+    if (timeout != 0) {
+        pfd.fd = hp->fd;
+        pfd.events = POLLIN;
+
+        if ((poll(&pfd, 1, timeout) < 0) && (errno != EINTR)) {
+            return -1;
+        }
+    }
+
+    for (;;) {
+        iov.iov_base = buf;
+        iov.iov_len = sizeof buf - 1;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_name = &addr;
+        msg.msg_namelen = sizeof addr;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof cbuf;
+
+        res = recvmsg(hp->fd, &msg, 0);
+
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return ((errno == EAGAIN) || (count > 0)) ? count : -1;
+        }
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+
+        /* Only trust the events of root, as udevd runs as root */
+        if ((cmsg == NULL) || (cmsg->cmsg_type != SCM_CREDENTIALS)) {
+            continue;
+        }
+
+        cred = (struct ucred *) CMSG_DATA(cmsg);
+
+        if (cred->uid != 0) {
+            continue;
+        }
+
+        buf[res] = 0;
+        count += g710p_hotplug_uevent(hp, buf, res);
+    }
+}
@@ -0,0 +1,688 @@
+/*
+ * Copyright 2016 James Geboski <jgeboski@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file */
+
+#include <assert.h>
+#include <libusb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "g710p-private.h"
+
+#define G710P_LIBUSB_TRANSFERS  8  /**< The interrupt transfers in flight. */
+#define G710P_LIBUSB_QUEUE  64  /**< The size of the report queue. */
+#define G710P_LIBUSB_TIMEOUT  1000  /**< The control transfer timeout. */
+#define G710P_LIBUSB_PATH_SIZE  16  /**< The size of a device path. */
+#define G710P_ERROR_SIZE  128  /**< The size of the error description. */
+
+#define G710P_HID_GET_REPORT  0x01  /**< The HID GET_REPORT request. */
+#define G710P_HID_SET_REPORT  0x09  /**< The HID SET_REPORT request. */
+#define G710P_HID_FEATURE  0x03  /**< The HID feature report type. */
+
+
+/** Device handle of the libusb backend. */
+typedef struct g710p_libusb g710p_libusb_t;
+
+
+/**
+ * Device handle of the libusb backend. Several interrupt transfers are
+ * kept in flight at all times. Without a callback, their reports are
+ * queued in a single-producer, single-consumer queue, where the
+ * producer is whichever thread holds the libusb event lock. The epoll
+ * descriptor of the device waits on both the eventfd, which is
+ * signalled when a report is queued or the device fails, and on the
+ * descriptors of libusb, whose events are handled by reading.
+ */
+struct g710p_libusb
+{
+    libusb_device_handle *handle;  /**< The \c libusb_device_handle. */
+    int intf;  /**< The claimed interface number. */
+    uint8_t endpoint;  /**< The interrupt IN endpoint. */
+
+    /** The interrupt IN transfers. */
+    struct libusb_transfer *transfers[G710P_LIBUSB_TRANSFERS];
+    uint8_t *buffers;  /**< The buffers of the transfers. */
+    size_t packet;  /**< The size of each transfer buffer. */
+    int active;  /**< The number of transfers in flight. */
+    int closing;  /**< If the transfers are being cancelled. */
+    int failed;  /**< If the device failed, such as by removal. */
+    int efd;  /**< The eventfd signalled when a report is queued. */
+    int pfd;  /**< The epoll descriptor of the device. */
+
+    g710p_device_t *dev;  /**< The #g710p_device of the callback. */
+    g710p_report_func_t func;  /**< The report callback, or \c NULL. */
+    void *data;  /**< The user defined data of the callback. */
+
+    g710p_raw_report_t queue[G710P_LIBUSB_QUEUE];  /**< The reports. */
+    unsigned int head;  /**< The queue head, owned by the consumer. */
+    unsigned int tail;  /**< The queue tail, owned by the producer. */
+
+    wchar_t error[G710P_ERROR_SIZE];  /**< The most recent error. */
+};
+
+
+static libusb_context *g710p_libusb_ctx = NULL;
+static int g710p_libusb_epfd = -1;
+
+
+/* The poll and epoll event bits have the same values on Linux */
+static void LIBUSB_CALL
+g710p_libusb_pollfd_added(int fd, short events, void *data)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof ev);
+    ev.events = events;
+    ev.data.fd = fd;
+    epoll_ctl(g710p_libusb_epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void LIBUSB_CALL
+g710p_libusb_pollfd_removed(int fd, void *data)
+{
+    epoll_ctl(g710p_libusb_epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/* The descriptors of libusb are gathered in one epoll instance, which
+ * is shared by the epoll descriptors of every device. The transfers
+ * have no timeouts, so the timerfd of libusb is not required.
+ */
+static int
+g710p_libusb_init(void)
+{
+    const struct libusb_pollfd **pollfds;
+    size_t i;
+
+    if (libusb_init(&g710p_libusb_ctx) != 0) {
+        return 0;
+    }
+
+    g710p_libusb_epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (g710p_libusb_epfd == -1) {
+        libusb_exit(g710p_libusb_ctx);
+        g710p_libusb_ctx = NULL;
+        return 0;
+    }
+
+    /* Added twice at worst, which epoll_ctl() rejects */
+    libusb_set_pollfd_notifiers(g710p_libusb_ctx, g710p_libusb_pollfd_added,
+                                g710p_libusb_pollfd_removed, NULL);
+    pollfds = libusb_get_pollfds(g710p_libusb_ctx);
+
+    for (i = 0; (pollfds != NULL) && (pollfds[i] != NULL); i++) {
+        g710p_libusb_pollfd_added(pollfds[i]->fd, pollfds[i]->events, NULL);
+    }
+
+    libusb_free_pollfds(pollfds);
+    return 1;
+}
+
+static int
+g710p_libusb_exit(void)
+{
+    libusb_set_pollfd_notifiers(g710p_libusb_ctx, NULL, NULL, NULL);
+    libusb_exit(g710p_libusb_ctx);
+    close(g710p_libusb_epfd);
+    g710p_libusb_ctx = NULL;
+    g710p_libusb_epfd = -1;
+    return 1;
+}
+
+static int
+g710p_libusb_result(g710p_libusb_t *ldev, int res)
+{
+    if (res < 0) {
+        mbstowcs(ldev->error, libusb_strerror(res), G710P_ERROR_SIZE - 1);
+        return -1;
+    }
+
+    ldev->error[0] = 0;
+    return res;
+}
+
+static int
+g710p_libusb_supported(libusb_device *dev)
+{
+    struct libusb_device_descriptor desc;
+
+    return (libusb_get_device_descriptor(dev, &desc) == 0) &&
+           (desc.idVendor == G710P_VENDOR_ID) &&
+           (desc.idProduct == G710P_PRODUCT_ID);
+}
+
+static char **
+g710p_libusb_list_get(void)
+{
+    char *buf;
+    char **devlist;
+    libusb_device **devs;
+    long count;
+    long i;
+    size_t n = 0;
+    size_t size = 0;
+
+    count = libusb_get_device_list(g710p_libusb_ctx, &devs);
+
+    if (count < 0) {
+        count = 0;
+        devs = NULL;
+    }
+
+    buf = malloc(G710P_LIBUSB_PATH_SIZE * (count + 1));
+    assert(buf != NULL);
+
+    for (i = 0; i < count; i++) {
+        if (!g710p_libusb_supported(devs[i])) {
+            continue;
+        }
+
+        /* The same path format as hidapi-libusb */
+        size += snprintf(buf + size, G710P_LIBUSB_PATH_SIZE, "%04x:%04x:%02x",
+                         libusb_get_bus_number(devs[i]),
+                         libusb_get_device_address(devs[i]),
+                         G710P_INTERFACE) + 1;
+        n++;
+    }
+
+    if (devs != NULL) {
+        libusb_free_device_list(devs, 1);
+    }
+
+    devlist = g710p_list_pack(buf, size, n);
+    free(buf);
+    return devlist;
+}
+
+static libusb_device_handle *
+g710p_libusb_open_path(const char *path, int *intf)
+{
+    libusb_device **devs;
+    libusb_device_handle *handle = NULL;
+    long count;
+    long i;
+    unsigned int addr;
+    unsigned int bus;
+    unsigned int num;
+
+    if (sscanf(path, "%x:%x:%x", &bus, &addr, &num) != 3) {
+        return NULL;
+    }
+
+    count = libusb_get_device_list(g710p_libusb_ctx, &devs);
+
+    for (i = 0; i < count; i++) {
+        if ((libusb_get_bus_number(devs[i]) == bus) &&
+            (libusb_get_device_address(devs[i]) == addr) &&
+            g710p_libusb_supported(devs[i]))
+        {
+            if (libusb_open(devs[i], &handle) != 0) {
+                handle = NULL;
+            }
+
+            break;
+        }
+    }
+
+    if (count >= 0) {
+        libusb_free_device_list(devs, 1);
+    }
+
+    *intf = num;
+    return handle;
+}
+
+static int
+g710p_libusb_endpoint(g710p_libusb_t *ldev)
+{
+    const struct libusb_endpoint_descriptor *ep;
+    const struct libusb_interface_descriptor *alt;
+    int i;
+    int ret = 0;
+    struct libusb_config_descriptor *conf;
+
+    if (libusb_get_active_config_descriptor(libusb_get_device(ldev->handle), &conf) != 0) {
+        return 0;
+    }
+
+    if ((ldev->intf < conf->bNumInterfaces) &&
+        (conf->interface[ldev->intf].num_altsetting > 0))
+    {
+        alt = &conf->interface[ldev->intf].altsetting[0];
+
+        for (i = 0; (i < alt->bNumEndpoints) && !ret; i++) {
+            ep = &alt->endpoint[i];
+
+            if (((ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN) &&
+                ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) == LIBUSB_TRANSFER_TYPE_INTERRUPT))
+            {
+                ldev->endpoint = ep->bEndpointAddress;
+                ldev->packet = ep->wMaxPacketSize;
+                ret = 1;
+            }
+        }
+    }
+
+    libusb_free_config_descriptor(conf);
+    return ret;
+}
+
+static int
+g710p_libusb_poll_open(g710p_libusb_t *ldev)
+{
+    struct epoll_event ev;
+
+    ldev->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ldev->pfd = epoll_create1(EPOLL_CLOEXEC);
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+
+    if ((ldev->efd != -1) && (ldev->pfd != -1) &&
+        (epoll_ctl(ldev->pfd, EPOLL_CTL_ADD, ldev->efd, &ev) == 0) &&
+        (epoll_ctl(ldev->pfd, EPOLL_CTL_ADD, g710p_libusb_epfd, &ev) == 0))
+    {
+        return 1;
+    }
+
+    if (ldev->pfd != -1) {
+        close(ldev->pfd);
+    }
+
+    if (ldev->efd != -1) {
+        close(ldev->efd);
+    }
+
+    return 0;
+}
+
+static void
+g710p_libusb_push(g710p_libusb_t *ldev, const uint8_t *data, int size)
+{
+    g710p_raw_report_t *report;
+    unsigned int head;
+    unsigned int tail;
+
+    if ((size <= 0) || (size > G710P_REPORT_SIZE)) {
+        return;
+    }
+
+    tail = ldev->tail;
+    head = __atomic_load_n(&ldev->head, __ATOMIC_ACQUIRE);
+
+    /* Drop the newest report when full, like the hidraw queue */
+    if ((tail - head) >= G710P_LIBUSB_QUEUE) {
+        return;
+    }
+
+    report = &ldev->queue[tail % G710P_LIBUSB_QUEUE];
+    report->size = size;
+    memcpy(report->data, data, size);
+    __atomic_store_n(&ldev->tail, tail + 1, __ATOMIC_RELEASE);
+    eventfd_write(ldev->efd, 1);
+}
+
+static int
+g710p_libusb_pop(g710p_libusb_t *ldev, uint8_t *data, size_t size)
+{
+    eventfd_t value;
+    g710p_raw_report_t *report;
+    unsigned int head;
+    unsigned int tail;
+
+    head = ldev->head;
+    tail = __atomic_load_n(&ldev->tail, __ATOMIC_ACQUIRE);
+
+    /* Clear the eventfd before checking again, so that a report queued
+     * in between leaves it signalled */
+    if ((head == tail) && !ldev->failed) {
+        eventfd_read(ldev->efd, &value);
+        tail = __atomic_load_n(&ldev->tail, __ATOMIC_ACQUIRE);
+    }
+
+    if (head == tail) {
+        return 0;
+    }
+
+    report = &ldev->queue[head % G710P_LIBUSB_QUEUE];
+
+    if (size > report->size) {
+        size = report->size;
+    }
+
+    memcpy(data, report->data, size);
+    __atomic_store_n(&ldev->head, head + 1, __ATOMIC_RELEASE);
+    return size;
+}
+
+static void LIBUSB_CALL
+g710p_libusb_callback(struct libusb_transfer *xfer)
+{
+    g710p_libusb_t *ldev = xfer->user_data;
+    g710p_report_t report;
+
+    switch (xfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        if (ldev->func == NULL) {
+            g710p_libusb_push(ldev, xfer->buffer, xfer->actual_length);
+        } else if (g710p_report_decode(ldev->dev, xfer->buffer, xfer->actual_length, &report)) {
+            ldev->func(ldev->dev, &report, ldev->data);
+        }
+        break;
+
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        break;
+
+    case LIBUSB_TRANSFER_CANCELLED:
+        ldev->active--;
+        return;
+
+    default:
+        ldev->failed = 1;
+        ldev->active--;
+        eventfd_write(ldev->efd, 1);
+        return;
+    }
+
+    if (ldev->closing) {
+        ldev->active--;
+    } else if (libusb_submit_transfer(xfer) != 0) {
+        ldev->failed = 1;
+        ldev->active--;
+        eventfd_write(ldev->efd, 1);
+    }
+}
+
+static void
+g710p_libusb_cancel(g710p_libusb_t *ldev)
+{
+    int i;
+    struct timeval tv = {0, 100000};
+
+    ldev->closing = 1;
+
+    for (i = 0; i < G710P_LIBUSB_TRANSFERS; i++) {
+        if (ldev->transfers[i] != NULL) {
+            libusb_cancel_transfer(ldev->transfers[i]);
+        }
+    }
+
+    while (ldev->active > 0) {
+        if (libusb_handle_events_timeout_completed(g710p_libusb_ctx, &tv, NULL) != 0) {
+            break;
+        }
+    }
+
+    for (i = 0; i < G710P_LIBUSB_TRANSFERS; i++) {
+        if (ldev->transfers[i] != NULL) {
+            libusb_free_transfer(ldev->transfers[i]);
+        }
+    }
+}
+
+static void
+g710p_libusb_close(void *handle)
+{
+    g710p_libusb_t *ldev = handle;
+
+    g710p_libusb_cancel(ldev);
+    libusb_release_interface(ldev->handle, ldev->intf);
+    libusb_close(ldev->handle);
+    close(ldev->pfd);
+    close(ldev->efd);
+    free(ldev->buffers);
+    free(ldev);
+}
+
+static void *
+g710p_libusb_open(const char *path)
+{
+    g710p_libusb_t *ldev;
+    int i;
+    int res;
+    struct libusb_transfer *xfer;
+
+    ldev = calloc(1, sizeof *ldev);
+    assert(ldev != NULL);
+    ldev->handle = g710p_libusb_open_path(path, &ldev->intf);
+
+    if (ldev->handle == NULL) {
+        free(ldev);
+        return NULL;
+    }
+
+    if (!g710p_libusb_endpoint(ldev)) {
+        g710p_errorln("Failed to find the interrupt endpoint of %s", path);
+        libusb_close(ldev->handle);
+        free(ldev);
+        return NULL;
+    }
+
+    libusb_set_auto_detach_kernel_driver(ldev->handle, 1);
+    res = libusb_claim_interface(ldev->handle, ldev->intf);
+
+    if (res != 0) {
+        g710p_errorln("Failed to claim %s: %s", path, libusb_strerror(res));
+        libusb_close(ldev->handle);
+        free(ldev);
+        return NULL;
+    }
+
+    if (!g710p_libusb_poll_open(ldev)) {
+        g710p_errorln("Failed to create the descriptors of %s", path);
+        libusb_release_interface(ldev->handle, ldev->intf);
+        libusb_close(ldev->handle);
+        free(ldev);
+        return NULL;
+    }
+
+    ldev->buffers = malloc(ldev->packet * G710P_LIBUSB_TRANSFERS);
+    assert(ldev->buffers != NULL);
+
+    for (i = 0; i < G710P_LIBUSB_TRANSFERS; i++) {
+        xfer = libusb_alloc_transfer(0);
+        assert(xfer != NULL);
+        ldev->transfers[i] = xfer;
+
+        libusb_fill_interrupt_transfer(xfer, ldev->handle, ldev->endpoint,
+                                       ldev->buffers + (i * ldev->packet),
+                                       ldev->packet, g710p_libusb_callback,
+                                       ldev, 0);
+
+        if (libusb_submit_transfer(xfer) != 0) {
+            g710p_errorln("Failed to submit transfers for %s", path);
+            g710p_libusb_close(ldev);
+            return NULL;
+        }
+
+        ldev->active++;
+    }
+
+    return ldev;
+}
+
+static int
+g710p_libusb_fd(void *handle)
+{
+    g710p_libusb_t *ldev = handle;
+
+    return ldev->pfd;
+}
+
+static const wchar_t *
+g710p_libusb_error(void *handle)
+{
+    g710p_libusb_t *ldev = handle;
+
+    return (ldev->error[0] != 0) ? ldev->error : NULL;
+}
+
+static int
+g710p_libusb_dispatch(int timeout)
+{
+    int res;
+    struct timeval tv;
+
+    if (timeout < 0) {
+        res = libusb_handle_events_completed(g710p_libusb_ctx, NULL);
+    } else {
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        res = libusb_handle_events_timeout_completed(g710p_libusb_ctx, &tv, NULL);
+    }
+
+    return (res == 0) || (res == LIBUSB_ERROR_INTERRUPTED);
+}
+
+static int
+g710p_libusb_read(void *handle, uint8_t *data, size_t size, int timeout)
+{
+    g710p_libusb_t *ldev = handle;
+    int res;
+    int64_t deadline = 0;
+    int64_t remaining = 0;
+
+    if (timeout > 0) {
+        deadline = g710p_time_ms() + timeout;
+    }
+
+    for (;;) {
+        res = g710p_libusb_pop(ldev, data, size);
+
+        if (res > 0) {
+            return g710p_libusb_result(ldev, res);
+        }
+
+        if (ldev->failed) {
+            return g710p_libusb_result(ldev, LIBUSB_ERROR_NO_DEVICE);
+        }
+
+        if (timeout > 0) {
+            remaining = deadline - g710p_time_ms();
+
+            if (remaining < 0) {
+                remaining = 0;
+            }
+        }
+
+        if (!g710p_libusb_dispatch((timeout < 0) ? -1 : remaining)) {
+            return g710p_libusb_result(ldev, LIBUSB_ERROR_IO);
+        }
+
+        if ((timeout >= 0) && (remaining == 0)) {
+            res = g710p_libusb_pop(ldev, data, size);
+            return g710p_libusb_result(ldev, res);
+        }
+    }
+}
+
+static int
+g710p_libusb_get_feature(void *handle, uint8_t *data, size_t size)
+{
+    g710p_libusb_t *ldev = handle;
+    int res;
+
+    res = libusb_control_transfer(
+        ldev->handle,
+        LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+        G710P_HID_GET_REPORT,
+        (G710P_HID_FEATURE << 8) | data[0],
+        ldev->intf,
+        data,
+        size,
+        G710P_LIBUSB_TIMEOUT
+    );
+
+    return g710p_libusb_result(ldev, res);
+}
+
+static int
+g710p_libusb_send_feature(void *handle, const uint8_t *data, size_t size)
+{
+    g710p_libusb_t *ldev = handle;
+    int res;
+
+    res = libusb_control_transfer(
+        ldev->handle,
+        LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+        G710P_HID_SET_REPORT,
+        (G710P_HID_FEATURE << 8) | data[0],
+        ldev->intf,
+        (uint8_t *) data,
+        size,
+        G710P_LIBUSB_TIMEOUT
+    );
+
+    return g710p_libusb_result(ldev, res);
+}
+
+static int
+g710p_libusb_async_start(void *handle, g710p_device_t *dev,
+                         g710p_report_func_t func, void *data)
+{
+    g710p_libusb_t *ldev = handle;
+    g710p_report_t report;
+    int res;
+    uint8_t buf[G710P_REPORT_SIZE];
+
+    /* Deliver the reports which were queued before the callback */
+    while ((res = g710p_libusb_pop(ldev, buf, sizeof buf)) > 0) {
+        if (g710p_report_decode(dev, buf, res, &report)) {
+            func(dev, &report, data);
+        }
+    }
+
+    ldev->dev = dev;
+    ldev->data = data;
+    ldev->func = func;
+    return 1;
+}
+
+static void
+g710p_libusb_async_stop(void *handle)
+{
+    g710p_libusb_t *ldev = handle;
+
+    ldev->func = NULL;
+    ldev->data = NULL;
+    ldev->dev = NULL;
+}
+
+/**
+ * The libusb backend, which claims the auxiliary interface and keeps
+ * several interrupt transfers in flight, without any reader thread.
+ */
+const g710p_backend_t g710p_backend_system = {
+    g710p_libusb_init,
+    g710p_libusb_exit,
+    g710p_libusb_list_get,
+    g710p_libusb_open,
+    g710p_libusb_close,
+    g710p_libusb_fd,
+    g710p_libusb_error,
+    g710p_libusb_read,
+    g710p_libusb_get_feature,
+    g710p_libusb_send_feature,
+    g710p_libusb_async_start,
+    g710p_libusb_async_stop,
+    g710p_libusb_dispatch,
+    0
+};
@@ -0,0 +1,256 @@
+/*
+ * Copyright 2016 James Geboski <jgeboski@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "g710p-private.h"
+
+
+/** In-memory device of the mock backend. */
+typedef struct g710p_mock g710p_mock_t;
+
+
+/**
+ * In-memory device of the mock backend.
+ */
+struct g710p_mock
+{
+    g710p_raw_report_t *reports;  /**< The scripted input reports. */
+    size_t count;  /**< The number of scripted input reports. */
+    size_t size;  /**< The allocated size of the scripted reports. */
+    size_t cursor;  /**< The index of the next scripted report. */
+    int repeat;  /**< If the script restarts once exhausted. */
+    uint8_t bl_lvls[4];  /**< The backlight levels feature report. */
+    uint8_t m_leds[2];  /**< The M keys LED feature report. */
+};
+
+
+static int
+g710p_mock_init(void)
+{
+    return 1;
+}
+
+static int
+g710p_mock_exit(void)
+{
+    return 1;
+}
+
+static void *
+g710p_mock_open_handle(const char *path)
+{
+    g710p_mock_t *mock;
+
+    mock = calloc(1, sizeof *mock);
+    assert(mock != NULL);
+    mock->bl_lvls[0] = G710P_REPORT_BL_LVLS;
+    mock->m_leds[0] = G710P_REPORT_M_LEDS;
+    return mock;
+}
+
+static void
+g710p_mock_close(void *handle)
+{
+    g710p_mock_t *mock = handle;
+
+    free(mock->reports);
+    free(mock);
+}
+
+static int
+g710p_mock_fd(void *handle)
+{
+    return -1;
+}
+
+static const wchar_t *
+g710p_mock_error(void *handle)
+{
+    return NULL;
+}
+
+static int
+g710p_mock_read(void *handle, uint8_t *data, size_t size, int timeout)
+{
+    g710p_raw_report_t *report;
+    g710p_mock_t *mock = handle;
+
+    if (mock->cursor >= mock->count) {
+        if (!mock->repeat || (mock->count == 0)) {
+            return 0;
+        }
+
+        mock->cursor = 0;
+    }
+
+    report = &mock->reports[mock->cursor++];
+
+    if (size > report->size) {
+        size = report->size;
+    }
+
+    memcpy(data, report->data, size);
+    return size;
+}
+
+static uint8_t *
+g710p_mock_feature(g710p_mock_t *mock, uint8_t type, size_t *size)
+{
+    switch (type) {
+    case G710P_REPORT_BL_LVLS:
+        *size = sizeof mock->bl_lvls;
+        return mock->bl_lvls;
+
+    case G710P_REPORT_M_LEDS:
+        *size = sizeof mock->m_leds;
+        return mock->m_leds;
+    }
+
+    return NULL;
+}
+
+static int
+g710p_mock_get_feature(void *handle, uint8_t *data, size_t size)
+{
+    size_t fsize;
+    uint8_t *feature;
+
+    feature = g710p_mock_feature(handle, data[0], &fsize);
+
+    if (feature == NULL) {
+        return -1;
+    }
+
+    if (size > fsize) {
+        size = fsize;
+    }
+
+    memcpy(data, feature, size);
+    return size;
+}
+
+static int
+g710p_mock_send_feature(void *handle, const uint8_t *data, size_t size)
+{
+    size_t fsize;
+    uint8_t *feature;
+
+    feature = g710p_mock_feature(handle, data[0], &fsize);
+
+    if ((feature == NULL) || (size != fsize)) {
+        return -1;
+    }
+
+    memcpy(feature, data, size);
+    return size;
+}
+
+/**
+ * The in-memory mock backend, available in every library flavour.
+ */
+const g710p_backend_t g710p_backend_mock = {
+    g710p_mock_init,
+    g710p_mock_exit,
+    NULL,
+    g710p_mock_open_handle,
+    g710p_mock_close,
+    g710p_mock_fd,
+    g710p_mock_error,
+    g710p_mock_read,
+    g710p_mock_get_feature,
+    g710p_mock_send_feature,
+    NULL,
+    NULL,
+    NULL,
+    0
+};
+
+/**
+ * Opens an in-memory mock device. The mock device serves scripted
+ * input reports added with #g710p_mock_report_add(), and keeps the
+ * feature report state in memory, all without any system calls. This
+ * is useful for testing and profiling the library apart from the
+ * hardware. When the script is exhausted, reads behave as if they
+ * timed out, regardless of the timeout. The device should be closed
+ * with #g710p_close() when no longer needed.
+ *
+ * @return The #g710p_device.
+ */
+g710p_device_t *
+g710p_mock_open(void)
+{
+    return g710p_device_new(&g710p_backend_mock, g710p_mock_open_handle(NULL));
+}
+
+/**
+ * Appends a raw input report to the script of a mock device. The first
+ * byte of \p data is the report type.
+ *
+ * @param dev The mock #g710p_device.
+ * @param data The report data.
+ * @param size The size of the report data.
+ * @return \c 1 if the report was added, otherwise \c 0.
+ */
+int
+g710p_mock_report_add(g710p_device_t *dev, const uint8_t *data, size_t size)
+{
+    g710p_raw_report_t *report;
+    g710p_mock_t *mock;
+
+    assert(dev != NULL);
+    assert(dev->backend == &g710p_backend_mock);
+    assert(data != NULL);
+    mock = dev->handle;
+
+    if ((size == 0) || (size > G710P_REPORT_SIZE)) {
+        return 0;
+    }
+
+    if (mock->count >= mock->size) {
+        mock->size = (mock->size != 0) ? (mock->size * 2) : 16;
+        mock->reports = realloc(mock->reports, (sizeof *report) * mock->size);
+        assert(mock->reports != NULL);
+    }
+
+    report = &mock->reports[mock->count++];
+    report->size = size;
+    memcpy(report->data, data, size);
+    return 1;
+}
+
+/**
+ * Sets whether the script of a mock device restarts from the first
+ * report once exhausted. This allows for an endless stream of reports.
+ *
+ * @param dev The mock #g710p_device.
+ * @param repeat \c 1 to repeat the script, otherwise \c 0.
+ */
+void
+g710p_mock_set_repeat(g710p_device_t *dev, int repeat)
+{
+    g710p_mock_t *mock;
+
+    assert(dev != NULL);
+    assert(dev->backend == &g710p_backend_mock);
+    mock = dev->handle;
+    mock->repeat = repeat;
+}
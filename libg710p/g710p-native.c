@@ -0,0 +1,185 @@
+/*
+ * Copyright 2016 James Geboski <jgeboski@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/hidraw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "g710p-private.h"
+
+#define G710P_ERROR_SIZE  128  /**< The size of the error description. */
+
+
+/** Device handle of the native hidraw backend. */
+typedef struct g710p_native g710p_native_t;
+
+
+/**
+ * Device handle of the native hidraw backend.
+ */
+struct g710p_native
+{
+    int fd;  /**< The hidraw file descriptor. */
+    wchar_t error[G710P_ERROR_SIZE];  /**< The most recent error. */
+};
+
+
+static int
+g710p_native_init(void)
+{
+    return 1;
+}
+
+static int
+g710p_native_exit(void)
+{
+    return 1;
+}
+
+static void *
+g710p_native_open(const char *path)
+{
+    char name[32];
+    g710p_native_t *ndev;
+    int fd;
+    struct stat st;
+
+    fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+    if (fd == -1) {
+        return NULL;
+    }
+
+    /* The keyboard has several hidraw nodes with the same IDs, which are
+     * told apart by their USB interface, as checked via sysfs. The node
+     * is found by its minor number, as the path may be a symlink.
+     */
+    if ((fstat(fd, &st) == 0) && S_ISCHR(st.st_mode)) {
+        snprintf(name, sizeof name, "hidraw%u", minor(st.st_rdev));
+    } else {
+        name[0] = 0;
+    }
+
+    if ((name[0] == 0) || !g710p_hidraw_supported(name)) {
+        g710p_errorln("Unsupported device %s", path);
+        close(fd);
+        return NULL;
+    }
+
+    ndev = calloc(1, sizeof *ndev);
+    assert(ndev != NULL);
+    ndev->fd = fd;
+    return ndev;
+}
+
+static void
+g710p_native_close(void *handle)
+{
+    g710p_native_t *ndev = handle;
+
+    close(ndev->fd);
+    free(ndev);
+}
+
+static int
+g710p_native_fd(void *handle)
+{
+    g710p_native_t *ndev = handle;
+
+    return ndev->fd;
+}
+
+static const wchar_t *
+g710p_native_error(void *handle)
+{
+    g710p_native_t *ndev = handle;
+
+    return (ndev->error[0] != 0) ? ndev->error : NULL;
+}
+
+static int
+g710p_native_result(g710p_native_t *ndev, int res)
+{
+    if (res < 0) {
+        mbstowcs(ndev->error, strerror(errno), G710P_ERROR_SIZE - 1);
+        return -1;
+    }
+
+    ndev->error[0] = 0;
+    return res;
+}
+
+static int
+g710p_native_read(void *handle, uint8_t *data, size_t size, int timeout)
+{
+    g710p_native_t *ndev = handle;
+    int res;
+
+    res = g710p_fd_read(ndev->fd, data, size, timeout);
+    return g710p_native_result(ndev, res);
+}
+
+static int
+g710p_native_get_feature(void *handle, uint8_t *data, size_t size)
+{
+    g710p_native_t *ndev = handle;
+    int res;
+
+    res = ioctl(ndev->fd, HIDIOCGFEATURE(size), data);
+    return g710p_native_result(ndev, res);
+}
+
+static int
+g710p_native_send_feature(void *handle, const uint8_t *data, size_t size)
+{
+    g710p_native_t *ndev = handle;
+    int res;
+
+    res = ioctl(ndev->fd, HIDIOCSFEATURE(size), data);
+    return g710p_native_result(ndev, res);
+}
+
+/**
+ * The native hidraw backend, which uses the hidraw devices directly
+ * rather than via hidapi.
+ */
+const g710p_backend_t g710p_backend_system = {
+    g710p_native_init,
+    g710p_native_exit,
+    g710p_hidraw_list_get,
+    g710p_native_open,
+    g710p_native_close,
+    g710p_native_fd,
+    g710p_native_error,
+    g710p_native_read,
+    g710p_native_get_feature,
+    g710p_native_send_feature,
+    NULL,
+    NULL,
+    NULL,
+    1
+};
@@ -0,0 +1,220 @@
+/*
+ * Copyright 2016 James Geboski <jgeboski@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file */
+
+#ifndef _G710P_PRIVATE_H_
+#define _G710P_PRIVATE_H_
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <wchar.h>
+
+#include "g710p.h"
+
+#define G710P_REPORT_SIZE  8  /**< The maximum input report size. */
+
+#define G710P_SYSFS_HIDRAW  "/sys/class/hidraw"  /**< The hidraw class. */
+
+#define G710P_NSEC_PER_SEC  1000000000ULL  /**< The nanoseconds of a second. */
+
+#define G710P_STATE_KB(v)  ((v) & 0xFF)  /**< The keyboard level. */
+#define G710P_STATE_WASD(v)  (((v) >> 8) & 0xFF)  /**< The WASD level. */
+#define G710P_STATE_LEDS(v)  (((v) >> 16) & 0xFF)  /**< The M key LEDs. */
+#define G710P_STATE_BL_LVLS  (1U << 24)  /**< The levels are present. */
+#define G710P_STATE_M_LEDS  (1U << 25)  /**< The M key LEDs are present. */
+
+/** The bits of the backlight levels of a packed state. */
+#define G710P_STATE_MASK_BL  (G710P_STATE_BL_LVLS | 0xFFFFU)
+
+/** The bits of the M key LEDs of a packed state. */
+#define G710P_STATE_MASK_LEDS  (G710P_STATE_M_LEDS | (0xFFU << 16))
+
+/** Packs the backlight levels into a packed state. */
+#define G710P_STATE_PACK_BL(kb, wasd) \
+    (G710P_STATE_BL_LVLS | ((uint32_t) (wasd) << 8) | (kb))
+
+/** Packs the M key LEDs into a packed state. */
+#define G710P_STATE_PACK_LEDS(keys) \
+    (G710P_STATE_M_LEDS | ((uint32_t) (keys) << 16))
+
+/** Operations of a device backend. */
+typedef struct g710p_backend g710p_backend_t;
+
+/** Raw input report as read from a device. */
+typedef struct g710p_raw_report g710p_raw_report_t;
+
+/** Reader thread and report ring of a device. */
+typedef struct g710p_reader g710p_reader_t;
+
+
+/**
+ * Internals of #g710p_context.
+ */
+struct g710p_context
+{
+    const g710p_backend_t *backend;  /**< The #g710p_backend. */
+};
+
+
+/**
+ * Operations of a device backend. Every library flavour links exactly
+ * one system backend, #g710p_backend_system, which is used for every
+ * device opened with #g710p_open(). The I/O operations follow the
+ * return conventions of hidapi: the number of bytes transferred, \c 0
+ * on timeout, or \c -1 on error.
+ */
+struct g710p_backend
+{
+    /** Initializes the backend, returns \c 1 on success. */
+    int (*init)(void);
+
+    /** Exits the backend, returns \c 1 on success. */
+    int (*exit)(void);
+
+    /** Gets the \c NULL terminated list of supported device paths. */
+    char **(*list_get)(void);
+
+    /** Opens a device by its path, returns \c NULL on error. */
+    void *(*open)(const char *path);
+
+    /** Closes a device handle. */
+    void (*close)(void *handle);
+
+    /** Gets the pollable file descriptor, or \c -1 if there is none. */
+    int (*fd)(void *handle);
+
+    /** Gets the most recent error description, or \c NULL. */
+    const wchar_t *(*error)(void *handle);
+
+    /** Reads an input report, waiting at most \p timeout milliseconds. */
+    int (*read)(void *handle, uint8_t *data, size_t size, int timeout);
+
+    /** Gets a feature report, the first byte is the report type. */
+    int (*get_feature)(void *handle, uint8_t *data, size_t size);
+
+    /** Sends a feature report, the first byte is the report type. */
+    int (*send_feature)(void *handle, const uint8_t *data, size_t size);
+
+    /** Starts delivering reports to a callback, or \c NULL if the
+     * backend does not support asynchronous delivery. */
+    int (*async_start)(void *handle, g710p_device_t *dev,
+                       g710p_report_func_t func, void *data);
+
+    /** Stops delivering reports to the callback. */
+    void (*async_stop)(void *handle);
+
+    /** Dispatches the pending events of every device. */
+    int (*dispatch)(int timeout);
+
+    /** If the device paths are hidraw device nodes. */
+    int hidraw;
+};
+
+/**
+ * Raw input report as read from a device.
+ */
+struct g710p_raw_report
+{
+    uint8_t size;  /**< The size of the report data. */
+    uint8_t data[G710P_REPORT_SIZE];  /**< The report data. */
+};
+
+/**
+ * Internals of #g710p_device.
+ */
+struct g710p_device
+{
+    const g710p_backend_t *backend;  /**< The #g710p_backend. */
+    void *handle;  /**< The backend device handle. */
+
+    /** The report read ahead by #g710p_wait_any(), for devices without
+     * a file descriptor. */
+    uint8_t pending[G710P_REPORT_SIZE];
+    int pending_size;  /**< The size of the pending report, or \c 0. */
+
+    /** The packed cached states, updated atomically, as the reader and
+     * writer threads update the cache at the same time. */
+    uint32_t cache;
+    uint32_t staged;  /**< The packed staged states. */
+
+    int writing;  /**< If the writer thread is running. */
+    pthread_t writer;  /**< The writer thread. */
+    sem_t writer_sem;  /**< Posted when the mailbox becomes non-empty. */
+    uint32_t mailbox;  /**< The packed states posted to the writer. */
+    uint64_t writer_period;  /**< The minimum nanoseconds between writes. */
+
+    g710p_reader_t *reader;  /**< The #g710p_reader, or \c NULL. */
+
+    uint8_t media_keys;  /**< The pressed media keys, for key events. */
+    uint16_t g_keys;  /**< The pressed G and M keys, for key events. */
+
+    g710p_stats_t stats;  /**< The #g710p_stats, updated atomically. */
+};
+
+
+extern const g710p_backend_t g710p_backend_system;
+
+extern const g710p_backend_t g710p_backend_mock;
+
+
+void
+g710p_errorln(const char *format, ...);
+
+char *
+g710p_strdup(const char *str);
+
+int64_t
+g710p_time_ms(void);
+
+int
+g710p_fd_read(int fd, uint8_t *data, size_t size, int timeout);
+
+int
+g710p_report_decode(g710p_device_t *dev, const uint8_t *data, int size,
+                    g710p_report_t *report);
+
+g710p_device_t *
+g710p_device_new(const g710p_backend_t *backend, void *handle);
+
+uint32_t
+g710p_state_merge(uint32_t *state, uint32_t mask, uint32_t bits);
+
+int
+g710p_io_read(g710p_device_t *dev, uint8_t *data, size_t size, int timeout);
+
+int
+g710p_io_get_feature(g710p_device_t *dev, uint8_t *data, size_t size);
+
+int
+g710p_io_send_feature(g710p_device_t *dev, const uint8_t *data, size_t size);
+
+void
+g710p_stats_count(uint64_t *counter);
+
+int
+g710p_hidraw_supported(const char *name);
+
+char **
+g710p_hidraw_list_get(void);
+
+char **
+g710p_list_pack(const char *strs, size_t size, size_t count);
+
+#endif /* _G710P_PRIVATE_H_ */
@@ -0,0 +1,251 @@
+/*
+ * Copyright 2016 James Geboski <jgeboski@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file */
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "g710p-private.h"
+
+#define G710P_READER_SIZE  256  /**< The size of the ring, a power of 2. */
+#define G710P_READER_BATCH  16  /**< The reports read per wake up. */
+#define G710P_READER_TIMEOUT  100  /**< The timeout without a descriptor. */
+#define G710P_CACHE_LINE  64  /**< The size of a cache line. */
+
+
+/**
+ * Reader thread and report ring of a device. The ring is a single
+ * producer, single consumer ring, where the reader thread produces and
+ * #g710p_reader_pop() consumes. The head and the tail live on separate
+ * cache lines, so the two threads do not contend for the same line.
+ */
+struct g710p_reader
+{
+    /** The ring head, owned by the consumer. */
+    unsigned int head __attribute__((aligned(G710P_CACHE_LINE)));
+
+    /** The ring tail, owned by the producer. */
+    unsigned int tail __attribute__((aligned(G710P_CACHE_LINE)));
+
+    /** The reports of the ring. */
+    g710p_timed_report_t reports[G710P_READER_SIZE]
+        __attribute__((aligned(G710P_CACHE_LINE)));
+
+    pthread_t thread;  /**< The reader thread. */
+    int quit;  /**< If the reader thread is stopping. */
+    int efd;  /**< The eventfd signalled to stop the reader thread. */
+};
+
+
+static void
+g710p_reader_push(g710p_reader_t *reader, const g710p_report_t *reports,
+                  int count, uint64_t time)
+{
+    g710p_timed_report_t *report;
+    int i;
+    unsigned int head;
+    unsigned int tail;
+
+    tail = reader->tail;
+    head = __atomic_load_n(&reader->head, __ATOMIC_ACQUIRE);
+
+    for (i = 0; i < count; i++) {
+        /* Drop the newest reports when full, like the hidraw queue */
+        if ((tail - head) >= G710P_READER_SIZE) {
+            break;
+        }
+
+        report = &reader->reports[tail & (G710P_READER_SIZE - 1)];
+        report->time = time;
+        report->report = reports[i];
+        tail++;
+    }
+
+    __atomic_store_n(&reader->tail, tail, __ATOMIC_RELEASE);
+}
+
+/* Blocks until the device is readable or the reader is stopped, only
+ * devices without a descriptor wake up to check for stopping.
+ */
+static int
+g710p_reader_wait(g710p_device_t *dev)
+{
+    int res;
+    struct pollfd pfds[2];
+
+    pfds[0].fd = dev->backend->fd(dev->handle);
+
+    if ((pfds[0].fd == -1) || (dev->pending_size > 0)) {
+        return g710p_wait_any(&dev, 1, NULL, G710P_READER_TIMEOUT);
+    }
+
+    pfds[0].events = POLLIN;
+    pfds[1].fd = dev->reader->efd;
+    pfds[1].events = POLLIN;
+    res = poll(pfds, 2, -1);
+
+    if (res < 0) {
+        return (errno == EINTR) ? 0 : -1;
+    }
+
+    return pfds[0].revents != 0;
+}
+
+static void *
+g710p_reader_run(void *data)
+{
+    g710p_device_t *dev = data;
+    g710p_reader_t *reader = dev->reader;
+    g710p_report_t reports[G710P_READER_BATCH];
+    int res;
+
+    while (!__atomic_load_n(&reader->quit, __ATOMIC_RELAXED)) {
+        res = g710p_reader_wait(dev);
+
+        if (res == 0) {
+            continue;
+        }
+
+        if (res > 0) {
+            res = g710p_report_get_many(dev, reports, G710P_READER_BATCH, 0);
+        }
+
+        if (res < 0) {
+            g710p_errorln("Failed to read the device, stopping the reader");
+            break;
+        }
+
+        g710p_reader_push(reader, reports, res, g710p_time_ns());
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts the reader thread of a device. The reader thread reads and
+ * decodes every report of the device into a fixed-size ring of
+ * #g710p_timed_report, which is drained with #g710p_reader_pop()
+ * without any locks or system calls. When the ring is full, the newest
+ * reports are dropped. While the reader thread is running, reports
+ * must not be read by any other means. It is safe to call this
+ * function more than once.
+ *
+ * @param dev The #g710p_device.
+ * @return \c 1 if the reader thread was started, otherwise \c 0.
+ */
+int
+g710p_reader_start(g710p_device_t *dev)
+{
+    void *ptr;
+
+    assert(dev != NULL);
+
+    if (dev->reader != NULL) {
+        return 1;
+    }
+
+    if (posix_memalign(&ptr, G710P_CACHE_LINE, sizeof *dev->reader) != 0) {
+        return 0;
+    }
+
+    dev->reader = ptr;
+    dev->reader->head = 0;
+    dev->reader->tail = 0;
+    dev->reader->quit = 0;
+    dev->reader->efd = eventfd(0, EFD_CLOEXEC);
+
+    if (dev->reader->efd == -1) {
+        free(dev->reader);
+        dev->reader = NULL;
+        return 0;
+    }
+
+    if (pthread_create(&dev->reader->thread, NULL, g710p_reader_run, dev) != 0) {
+        close(dev->reader->efd);
+        free(dev->reader);
+        dev->reader = NULL;
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Stops the reader thread of a device. The reports left in the ring
+ * are discarded. The thread is woken up to stop, except for devices
+ * without a file descriptor, for which this waits at most
+ * #G710P_READER_TIMEOUT milliseconds. It is safe to call this function
+ * more than once.
+ *
+ * @param dev The #g710p_device.
+ */
+void
+g710p_reader_stop(g710p_device_t *dev)
+{
+    assert(dev != NULL);
+
+    if (dev->reader == NULL) {
+        return;
+    }
+
+    __atomic_store_n(&dev->reader->quit, 1, __ATOMIC_RELAXED);
+    eventfd_write(dev->reader->efd, 1);
+    pthread_join(dev->reader->thread, NULL);
+    close(dev->reader->efd);
+    free(dev->reader);
+    dev->reader = NULL;
+}
+
+/**
+ * Pops the reports read by the reader thread of a device, in the order
+ * they were read. This never blocks, and costs no system calls, which
+ * makes it cheap enough to call once per frame of an application.
+ *
+ * @param dev The #g710p_device.
+ * @param reports The array of #g710p_timed_report.
+ * @param max The maximum number of reports to pop.
+ * @return The number of reports popped.
+ */
+size_t
+g710p_reader_pop(g710p_device_t *dev, g710p_timed_report_t *reports,
+                 size_t max)
+{
+    g710p_reader_t *reader;
+    size_t count = 0;
+    unsigned int head;
+    unsigned int tail;
+
+    assert(dev != NULL);
+    assert(dev->reader != NULL);
+    assert(reports != NULL);
+
+    reader = dev->reader;
+    head = reader->head;
+    tail = __atomic_load_n(&reader->tail, __ATOMIC_ACQUIRE);
+
+    for (; (head != tail) && (count < max); head++) {
+        reports[count++] = reader->reports[head & (G710P_READER_SIZE - 1)];
+    }
+
+    __atomic_store_n(&reader->head, head, __ATOMIC_RELEASE);
+    return count;
+}
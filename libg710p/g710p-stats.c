@@ -0,0 +1,180 @@
+/*
+ * Copyright 2016 James Geboski <jgeboski@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file */
+
+#include <assert.h>
+#include <string.h>
+
+#include "g710p-private.h"
+
+#define G710P_STATS_WORDS  (sizeof (g710p_stats_t) / sizeof (uint64_t))
+
+
+void
+g710p_stats_count(uint64_t *counter)
+{
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Records an operation in the #g710p_stats_op of a device. The counters
+ * are updated with relaxed atomics, as the operations of a device may
+ * be issued by its reader and writer threads at the same time.
+ *
+ * @param op The #g710p_stats_op.
+ * @param start The monotonic time the operation started.
+ * @param res The result of the operation.
+ * @param size The expected result, or \c 0 for any size.
+ */
+static void
+g710p_stats_op_add(g710p_stats_op_t *op, uint64_t start, int res,
+                   size_t size)
+{
+    int bucket;
+    uint64_t max;
+    uint64_t ns;
+
+    /* A short transfer of a feature report failed all the same */
+    if ((res < 0) || ((size > 0) && ((size_t) res != size))) {
+        g710p_stats_count(&op->errors);
+        return;
+    }
+
+    ns = g710p_time_ns() - start;
+    bucket = 63 - __builtin_clzll(ns | 1);
+
+    if (bucket >= G710P_STATS_BUCKETS) {
+        bucket = G710P_STATS_BUCKETS - 1;
+    }
+
+    g710p_stats_count(&op->count);
+    g710p_stats_count(&op->buckets[bucket]);
+    __atomic_fetch_add(&op->total_ns, ns, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&op->max_ns, __ATOMIC_RELAXED);
+
+    while ((ns > max) &&
+           !__atomic_compare_exchange_n(&op->max_ns, &max, ns, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* Non-blocking reads, such as the read-ahead of g710p_wait_any(),
+ * find nothing more often than not, so only blocking reads which find
+ * nothing are counted as timeouts.
+ */
+int
+g710p_io_read(g710p_device_t *dev, uint8_t *data, size_t size, int timeout)
+{
+    int res;
+    uint64_t start;
+
+    start = g710p_time_ns();
+    res = dev->backend->read(dev->handle, data, size, timeout);
+
+    if (res != 0) {
+        g710p_stats_op_add(&dev->stats.read, start, res, 0);
+    } else if (timeout != 0) {
+        g710p_stats_count(&dev->stats.read_timeouts);
+    }
+
+    return res;
+}
+
+int
+g710p_io_get_feature(g710p_device_t *dev, uint8_t *data, size_t size)
+{
+    g710p_stats_op_t *op;
+    int res;
+    uint64_t start;
+
+    assert((data[0] == G710P_REPORT_BL_LVLS) ||
+           (data[0] == G710P_REPORT_M_LEDS));
+
+    op = (data[0] == G710P_REPORT_BL_LVLS) ?
+         &dev->stats.get_bl_lvls : &dev->stats.get_m_leds;
+    start = g710p_time_ns();
+    res = dev->backend->get_feature(dev->handle, data, size);
+    g710p_stats_op_add(op, start, res, size);
+    return res;
+}
+
+int
+g710p_io_send_feature(g710p_device_t *dev, const uint8_t *data, size_t size)
+{
+    g710p_stats_op_t *op;
+    int res;
+    uint64_t start;
+
+    assert((data[0] == G710P_REPORT_BL_LVLS) ||
+           (data[0] == G710P_REPORT_M_LEDS));
+
+    op = (data[0] == G710P_REPORT_BL_LVLS) ?
+         &dev->stats.send_bl_lvls : &dev->stats.send_m_leds;
+    start = g710p_time_ns();
+    res = dev->backend->send_feature(dev->handle, data, size);
+    g710p_stats_op_add(op, start, res, size);
+    return res;
+}
+
+/**
+ * Gets the statistics of a device. Every input and feature report
+ * operation of the device is timed and counted, along with the types
+ * of the input reports. The statistics are gathered from the time the
+ * device was opened, or last reset with #g710p_stats_reset(). This is
+ * safe to call while the reader or writer threads are running, though
+ * the counters are not a consistent snapshot of one another.
+ *
+ * @param dev The #g710p_device.
+ * @param stats The return location for the #g710p_stats.
+ */
+void
+g710p_stats_get(g710p_device_t *dev, g710p_stats_t *stats)
+{
+    const uint64_t *src;
+    size_t i;
+    uint64_t *dst;
+
+    assert(dev != NULL);
+    assert(stats != NULL);
+
+    src = (const uint64_t *) &dev->stats;
+    dst = (uint64_t *) stats;
+
+    for (i = 0; i < G710P_STATS_WORDS; i++) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Resets the statistics of a device.
+ *
+ * @param dev The #g710p_device.
+ */
+void
+g710p_stats_reset(g710p_device_t *dev)
+{
+    size_t i;
+    uint64_t *dst;
+
+    assert(dev != NULL);
+
+    dst = (uint64_t *) &dev->stats;
+
+    for (i = 0; i < G710P_STATS_WORDS; i++) {
+        __atomic_store_n(&dst[i], 0, __ATOMIC_RELAXED);
+    }
+}
@@ -0,0 +1,191 @@
+/*
+ * Copyright 2016 James Geboski <jgeboski@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file */
+
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/input.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "g710p-private.h"
+
+#define G710P_LIST_STACK  1024  /**< The paths listed without allocation. */
+
+
+static int
+g710p_sysfs_read(const char *name, const char *file, char *buf, size_t size)
+{
+    char path[256];
+    int fd;
+    ssize_t res;
+
+    snprintf(path, sizeof path, G710P_SYSFS_HIDRAW "/%s/%s", name, file);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        return 0;
+    }
+
+    res = read(fd, buf, size - 1);
+    close(fd);
+
+    if (res < 0) {
+        return 0;
+    }
+
+    buf[res] = 0;
+    return 1;
+}
+
+/**
+ * Determines if a hidraw device is supported by this library. The HID
+ * device must match the vendor and product IDs, and its parent USB
+ * interface must be #G710P_INTERFACE. Devices without a USB interface
+ * are virtual (uhid) devices, which are accepted.
+ *
+ * @param name The name of the hidraw device.
+ * @return \c 1 if the device is supported, otherwise \c 0.
+ */
+int
+g710p_hidraw_supported(const char *name)
+{
+    char buf[512];
+    char *str;
+    unsigned int bus;
+    unsigned int intf;
+    unsigned int product;
+    unsigned int vendor;
+
+    if (!g710p_sysfs_read(name, "device/uevent", buf, sizeof buf)) {
+        return 0;
+    }
+
+    str = strstr(buf, "HID_ID=");
+
+    if ((str == NULL) ||
+        (sscanf(str, "HID_ID=%x:%x:%x", &bus, &vendor, &product) != 3) ||
+        (bus != BUS_USB) ||
+        (vendor != G710P_VENDOR_ID) ||
+        (product != G710P_PRODUCT_ID))
+    {
+        return 0;
+    }
+
+    if (!g710p_sysfs_read(name, "device/../bInterfaceNumber", buf, sizeof buf)) {
+        return 1;
+    }
+
+    return (sscanf(buf, "%x", &intf) == 1) && (intf == G710P_INTERFACE);
+}
+
+/**
+ * Packs a list of strings into a single allocation, which holds the
+ * \c NULL terminated array of pointers followed by the strings. The
+ * list is freed with a single free().
+ *
+ * @param strs The \c NUL separated strings.
+ * @param size The size of the strings, including every \c NUL.
+ * @param count The number of strings.
+ * @return The \c NULL terminated list of strings.
+ */
+char **
+g710p_list_pack(const char *strs, size_t size, size_t count)
+{
+    char **list;
+    char *data;
+    size_t i;
+
+    list = malloc(((sizeof *list) * (count + 1)) + size);
+    assert(list != NULL);
+    data = (char *) (list + count + 1);
+    memcpy(data, strs, size);
+
+    for (i = 0; i < count; i++) {
+        list[i] = data;
+        data += strlen(data) + 1;
+    }
+
+    list[count] = NULL;
+    return list;
+}
+
+/**
+ * Gets the list of supported hidraw device paths. The hidraw class is
+ * scanned directly, checking every device via sysfs, without opening
+ * any of the devices. The paths are packed into a single allocation
+ * with #g710p_list_pack().
+ *
+ * @return The \c NULL terminated list of device paths.
+ */
+char **
+g710p_hidraw_list_get(void)
+{
+    char **list;
+    char sbuf[G710P_LIST_STACK];
+    char *buf = sbuf;
+    DIR *dir;
+    int len;
+    size_t count = 0;
+    size_t bsize = sizeof sbuf;
+    size_t size = 0;
+    struct dirent *ent;
+
+    dir = opendir(G710P_SYSFS_HIDRAW);
+
+    while ((dir != NULL) && ((ent = readdir(dir)) != NULL)) {
+        if ((strncmp(ent->d_name, "hidraw", 6) != 0) ||
+            !g710p_hidraw_supported(ent->d_name))
+        {
+            continue;
+        }
+
+        len = strlen(ent->d_name) + sizeof "/dev/";
+
+        if ((size + len) > bsize) {
+            bsize *= 2;
+
+            if (buf == sbuf) {
+                buf = malloc(bsize);
+                assert(buf != NULL);
+                memcpy(buf, sbuf, size);
+            } else {
+                buf = realloc(buf, bsize);
+                assert(buf != NULL);
+            }
+        }
+
+        size += sprintf(buf + size, "/dev/%s", ent->d_name) + 1;
+        count++;
+    }
+
+    if (dir != NULL) {
+        closedir(dir);
+    }
+
+    list = g710p_list_pack(buf, size, count);
+
+    if (buf != sbuf) {
+        free(buf);
+    }
+
+    return list;
+}
@@ -0,0 +1,653 @@
+/*
+ * Copyright 2016 James Geboski <jgeboski@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file */
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "g710p-private.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define G710P_URING_POLL  (1ULL << 32)  /**< The user data flag of polls. */
+#define G710P_URING_CANCEL  (1ULL << 33)  /**< The flag of cancellations. */
+
+
+/** Device slot of a #g710p_uring. */
+typedef struct g710p_uring_slot g710p_uring_slot_t;
+
+
+/**
+ * Device slot of a #g710p_uring.
+ */
+struct g710p_uring_slot
+{
+    g710p_device_t *dev;  /**< The #g710p_device, or \c NULL if closed. */
+    uint8_t data[G710P_REPORT_SIZE];  /**< The buffer of the read. */
+    int armed;  /**< If a read into the buffer is posted. */
+    int bl_pending;  /**< If a backlight write is pending. */
+    int leds_pending;  /**< If an M keys LED write is pending. */
+    uint8_t kb_level;  /**< The pending keyboard backlight level. */
+    uint8_t wasd_level;  /**< The pending WASD backlight level. */
+    uint8_t m_leds;  /**< The pending M keys LEDs. */
+};
+
+/**
+ * Internals of #g710p_uring.
+ */
+struct g710p_uring
+{
+    int fd;  /**< The io_uring file descriptor. */
+    void *sq_ring;  /**< The mapped submission queue ring. */
+    void *cq_ring;  /**< The mapped completion queue ring. */
+    size_t sq_ring_size;  /**< The size of the mapped submission ring. */
+    size_t cq_ring_size;  /**< The size of the mapped completion ring. */
+    struct io_uring_sqe *sqes;  /**< The mapped submission entries. */
+    size_t sqes_size;  /**< The size of the mapped submission entries. */
+
+    unsigned int *sq_head;  /**< The submission queue head. */
+    unsigned int *sq_tail;  /**< The submission queue tail. */
+    unsigned int *sq_array;  /**< The submission queue index array. */
+    unsigned int sq_mask;  /**< The submission queue index mask. */
+    unsigned int sq_entries;  /**< The submission queue size. */
+    unsigned int sq_local;  /**< The unpublished submission tail. */
+    unsigned int sq_queued;  /**< The entries queued since submission. */
+
+    unsigned int *cq_head;  /**< The completion queue head. */
+    unsigned int *cq_tail;  /**< The completion queue tail. */
+    struct io_uring_cqe *cqes;  /**< The completion queue entries. */
+    unsigned int cq_mask;  /**< The completion queue index mask. */
+
+    g710p_uring_slot_t *slots;  /**< The device slots. */
+    size_t nslots;  /**< The number of device slots. */
+    size_t maxslots;  /**< The maximum number of device slots. */
+};
+
+
+static int
+g710p_uring_enter(g710p_uring_t *ring, unsigned int submit,
+                  unsigned int wait, int timeout)
+{
+    int res;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    unsigned int flags = 0;
+    void *argp = NULL;
+    size_t argsz = 0;
+
+    if (wait > 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+
+        if (timeout >= 0) {
+            memset(&arg, 0, sizeof arg);
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000;
+            arg.ts = (uintptr_t) &ts;
+            flags |= IORING_ENTER_EXT_ARG;
+            argp = &arg;
+            argsz = sizeof arg;
+        }
+    }
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE);
+    res = syscall(__NR_io_uring_enter, ring->fd, submit, wait, flags,
+                  argp, argsz);
+
+    if (res >= 0) {
+        ring->sq_queued -= res;
+    }
+
+    return res;
+}
+
+static struct io_uring_sqe *
+g710p_uring_sqe_get(g710p_uring_t *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int head;
+    unsigned int tail;
+
+    tail = ring->sq_local;
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if ((tail - head) >= ring->sq_entries) {
+        g710p_uring_enter(ring, ring->sq_queued, 0, 0);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+        if ((tail - head) >= ring->sq_entries) {
+            return NULL;
+        }
+    }
+
+    sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof *sqe);
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    ring->sq_local++;
+    ring->sq_queued++;
+    return sqe;
+}
+
+/* The hidraw descriptors are non-blocking, for which io_uring fails
+ * reads with EAGAIN rather than waiting. So each read is linked after
+ * a poll for input, whose completion is ignored. Skipping the poll
+ * completion with IOSQE_CQE_SKIP_SUCCESS would require Linux 5.17.
+ */
+static int
+g710p_uring_arm(g710p_uring_t *ring, size_t idx)
+{
+    g710p_uring_slot_t *slot = &ring->slots[idx];
+    int fd;
+    struct io_uring_sqe *poll;
+    struct io_uring_sqe *read;
+
+    fd = slot->dev->backend->fd(slot->dev->handle);
+    poll = g710p_uring_sqe_get(ring);
+    read = (poll != NULL) ? g710p_uring_sqe_get(ring) : NULL;
+
+    if (read == NULL) {
+        return 0;
+    }
+
+    poll->opcode = IORING_OP_POLL_ADD;
+    poll->fd = fd;
+    poll->poll32_events = POLLIN;
+    poll->flags = IOSQE_IO_LINK;
+    poll->user_data = G710P_URING_POLL | idx;
+
+    read->opcode = IORING_OP_READ;
+    read->fd = fd;
+    read->addr = (uintptr_t) slot->data;
+    read->len = sizeof slot->data;
+    read->user_data = idx;
+    slot->armed = 1;
+    return 1;
+}
+
+/* Cancels the posted polls and reads, and reaps every read, so that no
+ * read can complete into the buffers once they are freed. The poll is
+ * cancelled along with its read, as the read only starts once the poll
+ * completes.
+ */
+static int
+g710p_uring_cancel(g710p_uring_t *ring)
+{
+    g710p_uring_slot_t *slot;
+    int j;
+    size_t armed = 0;
+    size_t i;
+    struct io_uring_cqe *cqe;
+    struct io_uring_sqe *sqe;
+    unsigned int head;
+    unsigned int tail;
+
+    for (i = 0; i < ring->nslots; i++) {
+        if (!ring->slots[i].armed) {
+            continue;
+        }
+
+        for (j = 0; j < 2; j++) {
+            sqe = g710p_uring_sqe_get(ring);
+
+            if (sqe == NULL) {
+                return 0;
+            }
+
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = (j == 0) ? (G710P_URING_POLL | i) : i;
+            sqe->user_data = G710P_URING_CANCEL;
+        }
+
+        armed++;
+    }
+
+    while (armed > 0) {
+        if ((g710p_uring_enter(ring, ring->sq_queued, 1, -1) < 0) &&
+            (errno != EINTR))
+        {
+            return 0;
+        }
+
+        head = *ring->cq_head;
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++) {
+            cqe = &ring->cqes[head & ring->cq_mask];
+
+            if (cqe->user_data & (G710P_URING_POLL | G710P_URING_CANCEL)) {
+                continue;
+            }
+
+            slot = &ring->slots[cqe->user_data];
+
+            if (slot->armed) {
+                slot->armed = 0;
+                armed--;
+            }
+        }
+
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return 1;
+}
+
+static void
+g710p_uring_unmap(g710p_uring_t *ring)
+{
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+
+    if ((ring->cq_ring != NULL) && (ring->cq_ring != ring->sq_ring)) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+}
+
+static int
+g710p_uring_map(g710p_uring_t *ring, struct io_uring_params *p)
+{
+    uint8_t *cq;
+    uint8_t *sq;
+
+    ring->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof (unsigned int);
+    ring->cq_ring_size = p->cq_off.cqes + p->cq_entries * sizeof (struct io_uring_cqe);
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    sq = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+
+    if (sq == MAP_FAILED) {
+        return 0;
+    }
+
+    ring->sq_ring = sq;
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    } else {
+        cq = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+
+        if (cq == MAP_FAILED) {
+            return 0;
+        }
+    }
+
+    ring->cq_ring = cq;
+    ring->sqes_size = p->sq_entries * sizeof (struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        return 0;
+    }
+
+    ring->sq_head = (unsigned int *) (sq + p->sq_off.head);
+    ring->sq_tail = (unsigned int *) (sq + p->sq_off.tail);
+    ring->sq_array = (unsigned int *) (sq + p->sq_off.array);
+    ring->sq_mask = *(unsigned int *) (sq + p->sq_off.ring_mask);
+    ring->sq_entries = *(unsigned int *) (sq + p->sq_off.ring_entries);
+    ring->sq_local = *ring->sq_tail;
+
+    ring->cq_head = (unsigned int *) (cq + p->cq_off.head);
+    ring->cq_tail = (unsigned int *) (cq + p->cq_off.tail);
+    ring->cqes = (struct io_uring_cqe *) (cq + p->cq_off.cqes);
+    ring->cq_mask = *(unsigned int *) (cq + p->cq_off.ring_mask);
+    return 1;
+}
+
+/**
+ * Creates a new #g710p_uring, which reads the reports of many devices
+ * from a single thread via io_uring. A read is kept posted for every
+ * added device, and the completions are reaped in batches, so a batch
+ * of reports across every device costs a single system call. The ring
+ * should be freed with #g710p_uring_free() when no longer needed.
+ *
+ * @param devices The maximum number of devices.
+ * @return The #g710p_uring, or \c NULL if io_uring is unsupported.
+ */
+g710p_uring_t *
+g710p_uring_new(unsigned int devices)
+{
+    g710p_uring_t *ring;
+    struct io_uring_params p;
+
+    assert(devices > 0);
+    ring = calloc(1, sizeof *ring);
+    assert(ring != NULL);
+    memset(&p, 0, sizeof p);
+
+    /* Every device has a poll and a read posted, which both complete */
+    ring->fd = syscall(__NR_io_uring_setup, devices * 2, &p);
+
+    if (ring->fd < 0) {
+        g710p_errorln("Failed to setup io_uring: %s", strerror(errno));
+        free(ring);
+        return NULL;
+    }
+
+    if (!(p.features & IORING_FEAT_EXT_ARG) || !g710p_uring_map(ring, &p)) {
+        g710p_errorln("Failed to setup io_uring: unsupported kernel");
+        g710p_uring_unmap(ring);
+        close(ring->fd);
+        free(ring);
+        return NULL;
+    }
+
+    ring->maxslots = devices;
+    ring->slots = calloc(devices, sizeof *ring->slots);
+    assert(ring->slots != NULL);
+    return ring;
+}
+
+/**
+ * Frees all of the memory used by a #g710p_uring. This cancels all of
+ * the posted reads, and waits for them to complete, so it must be
+ * called before closing the devices.
+ *
+ * @param ring The #g710p_uring.
+ */
+void
+g710p_uring_free(g710p_uring_t *ring)
+{
+    int cancelled;
+
+    assert(ring != NULL);
+    cancelled = g710p_uring_cancel(ring);
+    g710p_uring_unmap(ring);
+    close(ring->fd);
+
+    /* Rather leak the buffers than free them while reads may be posted */
+    if (cancelled) {
+        free(ring->slots);
+    } else {
+        g710p_errorln("Failed to cancel the io_uring reads");
+    }
+
+    free(ring);
+}
+
+/**
+ * Adds a #g710p_device to a #g710p_uring. The device must be a hidraw
+ * device with a file descriptor (see #g710p_fd()). The reports of the device should no
+ * longer be read with #g710p_report_get().
+ *
+ * @param ring The #g710p_uring.
+ * @param dev The #g710p_device.
+ * @return \c 1 if the device was added, otherwise \c 0.
+ */
+int
+g710p_uring_add(g710p_uring_t *ring, g710p_device_t *dev)
+{
+    size_t idx;
+
+    assert(ring != NULL);
+    assert(dev != NULL);
+
+    if ((ring->nslots >= ring->maxslots) || !dev->backend->hidraw ||
+        (dev->backend->fd(dev->handle) == -1))
+    {
+        return 0;
+    }
+
+    idx = ring->nslots;
+    memset(&ring->slots[idx], 0, sizeof ring->slots[idx]);
+    ring->slots[idx].dev = dev;
+
+    if (!g710p_uring_arm(ring, idx)) {
+        return 0;
+    }
+
+    ring->nslots++;
+    return 1;
+}
+
+/**
+ * Queues a backlight levels write for a device of a #g710p_uring. The
+ * write is sent by the next #g710p_uring_wait(), replacing any write
+ * which is still queued. As io_uring has no operation for hidraw
+ * feature reports, the write is sent synchronously, but from the same
+ * loop as the reads.
+ *
+ * @param ring The #g710p_uring.
+ * @param dev The #g710p_device.
+ * @param kb The keyboard level.
+ * @param wasd The WASD level.
+ * @return \c 1 if the write was queued, otherwise \c 0.
+ */
+int
+g710p_uring_backlight_set_levels(g710p_uring_t *ring, g710p_device_t *dev,
+                                 uint8_t kb, uint8_t wasd)
+{
+    size_t i;
+
+    assert(ring != NULL);
+    assert(kb <= 4);
+    assert(wasd <= 4);
+
+    for (i = 0; i < ring->nslots; i++) {
+        if (ring->slots[i].dev == dev) {
+            ring->slots[i].kb_level = kb;
+            ring->slots[i].wasd_level = wasd;
+            ring->slots[i].bl_pending = 1;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Queues an M keys LED write for a device of a #g710p_uring. This
+ * behaves like #g710p_uring_backlight_set_levels().
+ *
+ * @param ring The #g710p_uring.
+ * @param dev The #g710p_device.
+ * @param keys The active M keys.
+ * @return \c 1 if the write was queued, otherwise \c 0.
+ */
+int
+g710p_uring_mkeys_set_leds(g710p_uring_t *ring, g710p_device_t *dev,
+                           uint8_t keys)
+{
+    size_t i;
+
+    assert(ring != NULL);
+
+    for (i = 0; i < ring->nslots; i++) {
+        if (ring->slots[i].dev == dev) {
+            ring->slots[i].m_leds = keys;
+            ring->slots[i].leds_pending = 1;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void
+g710p_uring_flush(g710p_uring_t *ring)
+{
+    g710p_uring_slot_t *slot;
+    size_t i;
+
+    for (i = 0; i < ring->nslots; i++) {
+        slot = &ring->slots[i];
+
+        if (slot->dev == NULL) {
+            continue;
+        }
+
+        if (slot->bl_pending) {
+            slot->bl_pending = 0;
+            g710p_backlight_set_levels(slot->dev, slot->kb_level,
+                                       slot->wasd_level);
+        }
+
+        if (slot->leds_pending) {
+            slot->leds_pending = 0;
+            g710p_mkeys_set_leds(slot->dev, slot->m_leds);
+        }
+    }
+}
+
+/**
+ * Waits for the reports of the devices of a #g710p_uring. The queued
+ * writes are sent, the completed reads are reaped and decoded, and the
+ * reads are posted again, all with a single system call. If \p timeout
+ * is \c -1, this function blocks until there is a report. If
+ * \p timeout is \c 0, the function does not block. A device which
+ * fails to read is dropped from the ring, and returned as an event with
+ * the error set, after which the device may be closed.
+ *
+ * @param ring The #g710p_uring.
+ * @param events The array of #g710p_uring_event.
+ * @param max The maximum number of events to return.
+ * @param timeout The timeout in milliseconds.
+ * @return The number of events, or \c -1 on error.
+ */
+int
+g710p_uring_wait(g710p_uring_t *ring, g710p_uring_event_t *events,
+                 size_t max, int timeout)
+{
+    g710p_uring_slot_t *slot;
+    int count = 0;
+    int res;
+    size_t idx;
+    struct io_uring_cqe *cqe;
+    unsigned int head;
+    unsigned int tail;
+
+    assert(ring != NULL);
+    assert(events != NULL);
+    g710p_uring_flush(ring);
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    if ((head == tail) || (ring->sq_queued > 0)) {
+        res = g710p_uring_enter(ring, ring->sq_queued,
+                                (head == tail) && (timeout != 0), timeout);
+
+        if ((res < 0) && (errno != ETIME) && (errno != EINTR)) {
+            g710p_errorln("Failed to wait on io_uring: %s", strerror(errno));
+            return -1;
+        }
+
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    for (; (head != tail) && ((size_t) count < max); head++) {
+        cqe = &ring->cqes[head & ring->cq_mask];
+        idx = cqe->user_data & ~G710P_URING_POLL;
+        slot = &ring->slots[idx];
+
+        if (cqe->user_data & G710P_URING_POLL) {
+            /* A failed poll also fails the linked read with ECANCELED */
+            continue;
+        }
+
+        slot->armed = 0;
+
+        if ((cqe->res < 0) && (cqe->res != -EAGAIN)) {
+            g710p_errorln("Failed to read data: %s", strerror(-cqe->res));
+            memset(&events[count], 0, sizeof events[count]);
+            events[count].dev = slot->dev;
+            events[count++].error = -cqe->res;
+            slot->dev = NULL;
+            continue;
+        }
+
+        if ((cqe->res > 0) &&
+            g710p_report_decode(slot->dev, slot->data, cqe->res,
+                                &events[count].report))
+        {
+            events[count].dev = slot->dev;
+            events[count++].error = 0;
+        }
+
+        g710p_uring_arm(ring, idx);
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+#else /* HAVE_LINUX_IO_URING_H */
+
+g710p_uring_t *
+g710p_uring_new(unsigned int devices)
+{
+    g710p_errorln("Failed to setup io_uring: unsupported");
+    return NULL;
+}
+
+void
+g710p_uring_free(g710p_uring_t *ring)
+{
+    assert(ring == NULL);
+}
+
+int
+g710p_uring_add(g710p_uring_t *ring, g710p_device_t *dev)
+{
+    return 0;
+}
+
+int
+g710p_uring_backlight_set_levels(g710p_uring_t *ring, g710p_device_t *dev,
+                                 uint8_t kb, uint8_t wasd)
+{
+    return 0;
+}
+
+int
+g710p_uring_mkeys_set_leds(g710p_uring_t *ring, g710p_device_t *dev,
+                           uint8_t keys)
+{
+    return 0;
+}
+
+int
+g710p_uring_wait(g710p_uring_t *ring, g710p_uring_event_t *events,
+                 size_t max, int timeout)
+{
+    return -1;
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
@@ -0,0 +1,248 @@
+/*
+ * Copyright 2016 James Geboski <jgeboski@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/** @file */
+
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+
+#include "g710p-private.h"
+
+#define G710P_MAILBOX_QUIT  (1U << 31)  /**< The writer is stopping. */
+
+
+/**
+ * Merges a state into the mailbox of a device. The mailbox is a single
+ * word, so a newer state simply replaces an older one which was never
+ * sent. The writer thread is only woken when the mailbox was empty, as
+ * otherwise it is already due to take the merged states.
+ *
+ * @param dev The #g710p_device.
+ * @param mask The bits of the mailbox being replaced.
+ * @param bits The new bits of the mailbox.
+ */
+static void
+g710p_mailbox_post(g710p_device_t *dev, uint32_t mask, uint32_t bits)
+{
+    if (g710p_state_merge(&dev->mailbox, mask, bits) == 0) {
+        sem_post(&dev->writer_sem);
+    }
+}
+
+/**
+ * Waits for the next tick of the writer, if the writer is rate limited.
+ * Every state posted while waiting is merged in the mailbox, so a tick
+ * costs at most one write per report type.
+ *
+ * @param dev The #g710p_device.
+ * @param next The time of the next tick, updated for the following one.
+ */
+static void
+g710p_writer_pace(g710p_device_t *dev, uint64_t *next)
+{
+    struct timespec ts;
+    uint64_t now;
+    uint64_t period;
+
+    period = __atomic_load_n(&dev->writer_period, __ATOMIC_RELAXED);
+    now = g710p_time_ns();
+
+    if ((period == 0) || (now >= *next)) {
+        *next = now + period;
+        return;
+    }
+
+    ts.tv_sec = *next / G710P_NSEC_PER_SEC;
+    ts.tv_nsec = *next % G710P_NSEC_PER_SEC;
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+
+    *next += period;
+}
+
+static void *
+g710p_writer_run(void *data)
+{
+    g710p_device_t *dev = data;
+    uint32_t box;
+    uint32_t cache;
+    uint64_t next = 0;
+
+    for (;;) {
+        if (sem_wait(&dev->writer_sem) != 0) {
+            assert(errno == EINTR);
+            continue;
+        }
+
+        g710p_writer_pace(dev, &next);
+        box = __atomic_exchange_n(&dev->mailbox, 0, __ATOMIC_ACQUIRE);
+        cache = __atomic_load_n(&dev->cache, __ATOMIC_ACQUIRE);
+
+        /* Skip the states which the device already has */
+        if (((box ^ cache) & G710P_STATE_MASK_BL) == 0) {
+            box &= ~G710P_STATE_BL_LVLS;
+        }
+
+        if (((box ^ cache) & G710P_STATE_MASK_LEDS) == 0) {
+            box &= ~G710P_STATE_M_LEDS;
+        }
+
+        if ((box & G710P_STATE_BL_LVLS) &&
+            !g710p_backlight_set_levels(dev, G710P_STATE_KB(box),
+                                        G710P_STATE_WASD(box)))
+        {
+            g710p_errorln("Failed to write the backlight levels");
+        }
+
+        if ((box & G710P_STATE_M_LEDS) &&
+            !g710p_mkeys_set_leds(dev, G710P_STATE_LEDS(box)))
+        {
+            g710p_errorln("Failed to write the M key LEDs");
+        }
+
+        if (box & G710P_MAILBOX_QUIT) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts the writer thread of a device. The writer thread sends the
+ * states posted with #g710p_backlight_post_levels() and
+ * #g710p_mkeys_post_leds(), so that the posting thread never waits on
+ * the device. Only the latest posted states are sent, the states which
+ * are replaced before the writer gets to them are never sent, nor are
+ * the states which match the cached states of the device. It is safe
+ * to call this function more than once.
+ *
+ * @param dev The #g710p_device.
+ * @return \c 1 if the writer thread was started, otherwise \c 0.
+ */
+int
+g710p_writer_start(g710p_device_t *dev)
+{
+    assert(dev != NULL);
+
+    if (dev->writing) {
+        return 1;
+    }
+
+    dev->mailbox = 0;
+
+    if (sem_init(&dev->writer_sem, 0, 0) != 0) {
+        return 0;
+    }
+
+    if (pthread_create(&dev->writer, NULL, g710p_writer_run, dev) != 0) {
+        sem_destroy(&dev->writer_sem);
+        return 0;
+    }
+
+    dev->writing = 1;
+    return 1;
+}
+
+/**
+ * Stops the writer thread of a device. The latest posted states are
+ * sent before the thread exits. It is safe to call this function more
+ * than once.
+ *
+ * @param dev The #g710p_device.
+ */
+void
+g710p_writer_stop(g710p_device_t *dev)
+{
+    assert(dev != NULL);
+
+    if (!dev->writing) {
+        return;
+    }
+
+    g710p_mailbox_post(dev, 0, G710P_MAILBOX_QUIT);
+    pthread_join(dev->writer, NULL);
+    sem_destroy(&dev->writer_sem);
+    dev->writing = 0;
+}
+
+/**
+ * Sets the maximum rate at which the writer thread of a device sends
+ * its states. The writes are paced to a fixed cadence, such as the
+ * 1000 Hz of the USB frames, or the 60 Hz of a display. All of the
+ * states posted within a tick are merged into a single write per
+ * report type, so the states can be posted at any rate while the load
+ * on the bus stays bounded. This can be called while the writer thread
+ * is running.
+ *
+ * @param dev The #g710p_device.
+ * @param hz The maximum writes per second, or \c 0 for no limit.
+ */
+void
+g710p_writer_set_rate(g710p_device_t *dev, unsigned int hz)
+{
+    uint64_t period = 0;
+
+    assert(dev != NULL);
+
+    if (hz > 0) {
+        period = G710P_NSEC_PER_SEC / hz;
+    }
+
+    __atomic_store_n(&dev->writer_period, period, __ATOMIC_RELAXED);
+}
+
+/**
+ * Posts the backlight brightness levels of the keyboard to the writer
+ * thread of a device. This never blocks, the levels are sent by the
+ * writer thread, which must have been started with
+ * #g710p_writer_start().
+ *
+ * @param dev The #g710p_device.
+ * @param kb The keyboard level.
+ * @param wasd The WASD level.
+ */
+void
+g710p_backlight_post_levels(g710p_device_t *dev, uint8_t kb, uint8_t wasd)
+{
+    assert(dev != NULL);
+    assert(dev->writing);
+    assert(kb <= 4);
+    assert(wasd <= 4);
+
+    g710p_mailbox_post(dev, G710P_STATE_MASK_BL,
+                       G710P_STATE_PACK_BL(kb, wasd));
+}
+
+/**
+ * Posts the LED states of the M keys to the writer thread of a device.
+ * This never blocks, the states are sent by the writer thread, which
+ * must have been started with #g710p_writer_start().
+ *
+ * @param dev The #g710p_device.
+ * @param keys The active M keys.
+ */
+void
+g710p_mkeys_post_leds(g710p_device_t *dev, uint8_t keys)
+{
+    assert(dev != NULL);
+    assert(dev->writing);
+
+    g710p_mailbox_post(dev, G710P_STATE_MASK_LEDS,
+                       G710P_STATE_PACK_LEDS(keys));
+}
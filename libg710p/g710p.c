@@ -18,41 +18,28 @@
 /** @file */
 
 #include <assert.h>
-#include <hidapi.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
-#include "g710p.h"
+#include "g710p-private.h"
 
-/**
- * Determines if a \c hid_device_info is supported by this library.
- *
- * @param dev The hid_device_info.
- * @returns \c 1 if the device is supported, otherwise \c 0.
- */
-#define G710P_DEVICE_SUPPORTED(dev) ( \
-        ((dev)->vendor_id == G710P_VENDOR_ID) && \
-        ((dev)->product_id == G710P_PRODUCT_ID) && \
-        ((dev)->interface_number == G710P_INTERFACE) && \
-        ((dev)->path != NULL) \
-    )
-
-
-/**
- * Internals of #g710p_device.
- */
-struct g710p_device
-{
-    hid_device *handle;  /**< The \c hid_device. */
-};
+#define G710P_WAIT_SLICE  10  /**< The poll slice for devices without a fd. */
+#define G710P_WAIT_STACK  16  /**< The devices waited on without allocation. */
 
 
-static int g710p_inited = 0;
+static pthread_mutex_t g710p_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int g710p_refs = 0;
+static g710p_context_t *g710p_default = NULL;
 
 
-static void
+void
 g710p_errorln(const char *format, ...)
 {
     va_list ap;
@@ -63,7 +50,7 @@ g710p_errorln(const char *format, ...)
     fprintf(stderr, "\n");
 }
 
-static char *
+char *
 g710p_strdup(const char *str)
 {
     char *ret;
@@ -79,38 +66,218 @@ g710p_strdup(const char *str)
     return memcpy(ret, str, len);
 }
 
+int
+g710p_fd_read(int fd, uint8_t *data, size_t size, int timeout)
+{
+    ssize_t res;
+    struct pollfd pfd;
+
+    for (;;) {
+        res = read(fd, data, size);
+
+        if (res >= 0) {
+            return res;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        }
+
+        if ((errno != EAGAIN) || (timeout == 0)) {
+            break;
+        }
+
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        res = poll(&pfd, 1, timeout);
+
+        if (res == 0) {
+            return 0;
+        }
+
+        if ((res < 0) && (errno != EINTR)) {
+            break;
+        }
+    }
+
+    return (errno == EAGAIN) ? 0 : -1;
+}
+
+/**
+ * Merges bits into a packed state, replacing the bits of \p mask. This
+ * is lock-free, so the threads of a device may merge at the same time.
+ *
+ * @param state The packed state.
+ * @param mask The bits being replaced.
+ * @param bits The new bits.
+ * @return The packed state before the merge.
+ */
+uint32_t
+g710p_state_merge(uint32_t *state, uint32_t mask, uint32_t bits)
+{
+    uint32_t new;
+    uint32_t old;
+
+    old = __atomic_load_n(state, __ATOMIC_RELAXED);
+
+    do {
+        new = (old & ~mask) | bits;
+    } while (!__atomic_compare_exchange_n(state, &old, new, 1,
+                                          __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+
+    return old;
+}
+
+g710p_device_t *
+g710p_device_new(const g710p_backend_t *backend, void *handle)
+{
+    g710p_device_t *dev;
+
+    dev = calloc(1, sizeof *dev);
+    assert(dev != NULL);
+    dev->backend = backend;
+    dev->handle = handle;
+    return dev;
+}
+
+static g710p_context_t *
+g710p_context_new_locked(void)
+{
+    g710p_context_t *ctx;
+
+    if ((g710p_refs == 0) && !g710p_backend_system.init()) {
+        return NULL;
+    }
+
+    g710p_refs++;
+    ctx = calloc(1, sizeof *ctx);
+    assert(ctx != NULL);
+    ctx->backend = &g710p_backend_system;
+    return ctx;
+}
+
+static int
+g710p_context_free_locked(g710p_context_t *ctx)
+{
+    assert(g710p_refs > 0);
+    free(ctx);
+
+    if (--g710p_refs == 0) {
+        return g710p_backend_system.exit();
+    }
+
+    return 1;
+}
+
+/**
+ * Creates a new #g710p_context. The context owns the initialization of
+ * the backend of the library, which is initialized by the first
+ * context, and exited with the last one. Contexts may be created and
+ * freed from any thread. The returned #g710p_context should be freed
+ * with #g710p_context_free() when no longer needed.
+ *
+ * Once a device is opened, it shares no state with other devices, so
+ * different devices can be used from different threads without any
+ * locking. A single device can be read from one thread, while its
+ * feature reports are read and written from other threads, such as the
+ * writer thread. The cache, the statistics and the mailbox of a device
+ * are all updated atomically. Reports of a single device must only be
+ * read from one thread at a time, and the stage of a device must only
+ * be used from one thread at a time.
+ *
+ * @return The #g710p_context, or \c NULL on error.
+ */
+g710p_context_t *
+g710p_context_new(void)
+{
+    g710p_context_t *ctx;
+
+    pthread_mutex_lock(&g710p_lock);
+    ctx = g710p_context_new_locked();
+    pthread_mutex_unlock(&g710p_lock);
+    return ctx;
+}
+
+/**
+ * Frees a #g710p_context. Every device opened with the context must be
+ * closed beforehand.
+ *
+ * @param ctx The #g710p_context.
+ * @return \c 1 if the context was successfully freed, otherwise \c 0.
+ */
+int
+g710p_context_free(g710p_context_t *ctx)
+{
+    int ret;
+
+    assert(ctx != NULL);
+
+    pthread_mutex_lock(&g710p_lock);
+    ret = g710p_context_free_locked(ctx);
+    pthread_mutex_unlock(&g710p_lock);
+    return ret;
+}
+
 /**
  * Initializes the library. This must be called at least once before
- * using the library. It is safe to call this function more than once.
+ * using #g710p_device_list_get() and #g710p_open(). It is safe to call
+ * this function more than once, and from any thread. This creates the
+ * default #g710p_context, which is shared by the functions without a
+ * context.
  *
  * @return \c 1 if the library successfully initialized, otherwise \c 0.
  */
 int
 g710p_init(void)
 {
-    if (g710p_inited) {
-        return 1;
+    int ret;
+
+    pthread_mutex_lock(&g710p_lock);
+
+    if (g710p_default == NULL) {
+        g710p_default = g710p_context_new_locked();
     }
 
-    g710p_inited = 1;
-    return hid_init() == 0;
+    ret = g710p_default != NULL;
+    pthread_mutex_unlock(&g710p_lock);
+    return ret;
 }
 
 /**
  * Exits the library by cleaning up everything that was initialized by
- * #g710p_init(). It is safe to call this function more than once.
+ * #g710p_init(). It is safe to call this function more than once, and
+ * from any thread.
  *
  * @return \c 1 if the library successfully exited, otherwise \c 0.
  */
 int
 g710p_exit(void)
 {
-    if (!g710p_inited) {
-        return 1;
+    int ret = 1;
+
+    pthread_mutex_lock(&g710p_lock);
+
+    if (g710p_default != NULL) {
+        ret = g710p_context_free_locked(g710p_default);
+        g710p_default = NULL;
     }
 
-    g710p_inited = 0;
-    return hid_exit() == 0;
+    pthread_mutex_unlock(&g710p_lock);
+    return ret;
+}
+
+static g710p_context_t *
+g710p_context_default(void)
+{
+    g710p_context_t *ctx;
+
+    pthread_mutex_lock(&g710p_lock);
+    ctx = g710p_default;
+    pthread_mutex_unlock(&g710p_lock);
+
+    assert(ctx != NULL);
+    return ctx;
 }
 
 /**
@@ -122,9 +289,24 @@ g710p_exit(void)
 const wchar_t *
 g710p_error(g710p_device_t *dev)
 {
-    assert(g710p_inited);
     assert(dev != NULL);
-    return hid_error(dev->handle);
+    return dev->backend->error(dev->handle);
+}
+
+/**
+ * Gets the list of device paths of a #g710p_context. This can be used
+ * with #g710p_context_open() to open all of the supported devices on
+ * the system. The returned list should be freed with
+ * #g710p_device_list_free() when no longer needed.
+ *
+ * @param ctx The #g710p_context.
+ * @return The \c NULL terminated list of device paths.
+ */
+char **
+g710p_context_list_get(g710p_context_t *ctx)
+{
+    assert(ctx != NULL);
+    return ctx->backend->list_get();
 }
 
 /**
@@ -138,33 +320,7 @@ g710p_error(g710p_device_t *dev)
 char **
 g710p_device_list_get(void)
 {
-    size_t i;
-    struct hid_device_info *dev;
-    struct hid_device_info *devs;
-    char **devlist;
-
-    assert(g710p_inited);
-    devs = hid_enumerate(G710P_VENDOR_ID, G710P_PRODUCT_ID);
-    assert(devs != NULL);
-
-    for (i = 1, dev = devs; dev != NULL; dev = dev->next) {
-        if (G710P_DEVICE_SUPPORTED(dev)) {
-            i++;
-        }
-    }
-
-    devlist = malloc((sizeof *devlist) * i);
-    assert(devlist != NULL);
-
-    for (i = 0, dev = devs; dev != NULL; dev = dev->next) {
-        if (G710P_DEVICE_SUPPORTED(dev)) {
-            devlist[i++] = g710p_strdup(dev->path);
-        }
-    }
-
-    hid_free_enumeration(devs);
-    devlist[i] = NULL;
-    return devlist;
+    return g710p_context_list_get(g710p_context_default());
 }
 
 /**
@@ -175,32 +331,27 @@ g710p_device_list_get(void)
 void
 g710p_device_list_free(char **devlist)
 {
-    size_t i;
-
     assert(devlist != NULL);
 
-    for (i = 0; devlist[i] != NULL; i++) {
-        free(devlist[i]);
-    }
-
+    /* The paths are packed into the same allocation as the list */
     free(devlist);
 }
 
 /**
- * Opens a supported device by its path.
+ * Opens a supported device of a #g710p_context by its path.
  *
+ * @param ctx The #g710p_context.
  * @param path The path of the device.
  * @return The #g710p_device or \c NULL on error.
  */
 g710p_device_t *
-g710p_open(const char *path)
+g710p_context_open(g710p_context_t *ctx, const char *path)
 {
-    g710p_device_t *dev;
-    hid_device *handle;
+    void *handle;
 
-    assert(g710p_inited);
+    assert(ctx != NULL);
     assert(path != NULL);
-    handle = hid_open_path(path);
+    handle = ctx->backend->open(path);
 
     if (handle == NULL) {
         g710p_errorln("Failed to open %s", path);
@@ -214,65 +365,331 @@ g710p_open(const char *path)
      * passes the path to a supported device.
      */
 
-    dev = malloc(sizeof *dev);
-    assert(dev != NULL);
-    dev->handle = handle;
-    return dev;
+    return g710p_device_new(ctx->backend, handle);
+}
+
+/**
+ * Opens a supported device by its path.
+ *
+ * @param path The path of the device.
+ * @return The #g710p_device or \c NULL on error.
+ */
+g710p_device_t *
+g710p_open(const char *path)
+{
+    return g710p_context_open(g710p_context_default(), path);
 }
 
 /**
  * Closes a #g710p_device. The frees all resources used by the device.
+ * The reader and writer threads of the device, if any, are stopped
+ * first.
  *
  * @param dev The #g710p_device.
  */
 void
 g710p_close(g710p_device_t *dev)
 {
-    assert(g710p_inited);
     assert(dev != NULL);
-    hid_close(dev->handle);
+    g710p_reader_stop(dev);
+    g710p_writer_stop(dev);
+    dev->backend->close(dev->handle);
     free(dev);
 }
 
+/**
+ * Gets the pollable file descriptor of a #g710p_device. The descriptor
+ * becomes readable when an input report is available, allowing the
+ * device to be integrated into the event loop of the caller. The
+ * descriptor must not be read or closed by the caller, the report
+ * should be read with #g710p_report_get(). The descriptor of a libusb
+ * device also becomes readable for the events of the other libusb
+ * devices, so reading it without blocking may find no report. Not
+ * every device has a file descriptor, such as mock devices, these can
+ * be waited on with #g710p_wait_any().
+ *
+ * @param dev The #g710p_device.
+ * @return The file descriptor, or \c -1 if the device has none.
+ */
+int
+g710p_fd(g710p_device_t *dev)
+{
+    assert(dev != NULL);
+    return dev->backend->fd(dev->handle);
+}
+
+int64_t
+g710p_time_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+/**
+ * Gets the current monotonic time, as used by the timestamps of the
+ * reports and key events.
+ *
+ * @return The monotonic time in nanoseconds.
+ */
+uint64_t
+g710p_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * G710P_NSEC_PER_SEC) + ts.tv_nsec;
+}
+
 static int
-g710p_read_check(int total, int required)
+g710p_wait_pending(g710p_device_t *dev)
 {
-    if (required != total) {
-        g710p_errorln("Expected to read %d bytes", required);
-        return 0;
+    int res;
+
+    if (dev->pending_size > 0) {
+        return 1;
     }
 
-    return 1;
+    res = g710p_io_read(dev, dev->pending, sizeof dev->pending, 0);
+
+    if (res > 0) {
+        dev->pending_size = res;
+    }
+
+    /* Report errors as readable, the following read reports them */
+    return res != 0;
 }
 
 /**
- * Populates a #g710p_report with a report read from the device. If
- * \p timeout is \c -1, this function blocks until there is something
- * to read. If \p timeout is \c 0, the function does not block.
+ * Waits for any of several devices to have an input report available.
+ * All of the devices are waited on at once, rather than one after the
+ * other. Devices with a file descriptor are waited on with poll(),
+ * and devices without one are checked every few milliseconds. If
+ * \p timeout is \c -1, this function blocks until a device is
+ * readable. If \p timeout is \c 0, the function does not block. The
+ * reports of the readable devices should then be read with
+ * #g710p_report_get(), which does not block for these devices.
  *
- * @param dev The #g710p_device.
- * @param report The #g710p_report.
+ * @param devs The array of #g710p_device.
+ * @param n The number of devices in \p devs.
+ * @param ready The return location for the readable states of each of
+ *              the devices (\c 1 if readable), or \c NULL.
  * @param timeout The timeout in milliseconds.
- * @return \c 1 if the report was successfully read, otherwise \c 0.
+ * @return The number of readable devices, \c 0 on timeout or
+ *         interruption by a signal, or \c -1 on error.
  */
 int
-g710p_report_get(g710p_device_t *dev, g710p_report_t *report, int timeout)
+g710p_wait_any(g710p_device_t **devs, size_t n, int *ready, int timeout)
 {
+    int count;
+    int fd;
+    int fdless;
     int res;
-    uint8_t data[8];
+    int slice;
+    int64_t deadline = 0;
+    int64_t remaining;
+    size_t i;
+    size_t j;
+    size_t nfds;
+    struct pollfd *pfds;
+    struct pollfd spfds[G710P_WAIT_STACK];
+    size_t sidxs[G710P_WAIT_STACK];
+    size_t *idxs;
 
-    assert(g710p_inited);
-    assert(dev != NULL);
-    assert(report != NULL);
+    assert(devs != NULL);
+
+    if (n == 0) {
+        return 0;
+    }
+
+    if (n <= G710P_WAIT_STACK) {
+        pfds = spfds;
+        idxs = sidxs;
+    } else {
+        pfds = malloc((sizeof *pfds) * n);
+        idxs = malloc((sizeof *idxs) * n);
+        assert((pfds != NULL) && (idxs != NULL));
+    }
+
+    if (timeout > 0) {
+        deadline = g710p_time_ms() + timeout;
+    }
+
+    for (;;) {
+        count = 0;
+        fdless = 0;
+        nfds = 0;
+
+        for (i = 0; i < n; i++) {
+            fd = devs[i]->backend->fd(devs[i]->handle);
+            res = 0;
+
+            if (devs[i]->pending_size > 0) {
+                res = 1;
+            } else if (fd != -1) {
+                pfds[nfds].fd = fd;
+                pfds[nfds].events = POLLIN;
+                idxs[nfds++] = i;
+            } else {
+                res = g710p_wait_pending(devs[i]);
+                fdless = 1;
+            }
+
+            if (ready != NULL) {
+                ready[i] = res;
+            }
+
+            count += res;
+        }
+
+        if ((count > 0) || (timeout == 0)) {
+            slice = 0;
+        } else if (timeout < 0) {
+            slice = fdless ? G710P_WAIT_SLICE : -1;
+        } else {
+            remaining = deadline - g710p_time_ms();
+            slice = (remaining > 0) ? remaining : 0;
+
+            if (fdless && (slice > G710P_WAIT_SLICE)) {
+                slice = G710P_WAIT_SLICE;
+            }
+        }
+
+        res = (nfds > 0) ? poll(pfds, nfds, slice) : 0;
+
+        if ((res == 0) && (nfds == 0) && (slice > 0)) {
+            /* Only devices without a file descriptor, sleep a slice */
+            res = poll(NULL, 0, slice);
+        }
+
+        if (res < 0) {
+            count = (errno == EINTR) ? 0 : -1;
+            break;
+        }
+
+        for (j = 0; j < nfds; j++) {
+            if (pfds[j].revents == 0) {
+                continue;
+            }
+
+            /* Only the hidraw descriptors are readable just for reports */
+            if (!devs[idxs[j]]->backend->hidraw &&
+                !g710p_wait_pending(devs[idxs[j]]))
+            {
+                continue;
+            }
+
+            if (ready != NULL) {
+                ready[idxs[j]] = 1;
+            }
+
+            count++;
+        }
+
+        if ((count > 0) || (slice == 0)) {
+            break;
+        }
+
+        if ((timeout > 0) && (g710p_time_ms() >= deadline)) {
+            break;
+        }
+    }
+
+    if (pfds != spfds) {
+        free(pfds);
+        free(idxs);
+    }
+
+    return count;
+}
+
+static int
+g710p_read_check(int total, int required)
+{
+    if (required != total) {
+        g710p_errorln("Expected to read %d bytes", required);
+        return 0;
+    }
+
+    return 1;
+}
+
+static int
+g710p_device_read(g710p_device_t *dev, uint8_t *data, int timeout)
+{
+    int res;
+
+    if (dev->pending_size > 0) {
+        res = dev->pending_size;
+        memcpy(data, dev->pending, res);
+        dev->pending_size = 0;
+        return res;
+    }
 
-    res = hid_read_timeout(dev->handle, data, sizeof data, timeout);
+    res = g710p_io_read(dev, data, G710P_REPORT_SIZE, timeout);
 
     if (res == -1) {
         g710p_errorln("Failed to read data");
+    }
+
+    return res;
+}
+
+static void
+g710p_report_count(g710p_device_t *dev, uint8_t type, int decoded)
+{
+    uint64_t *counter;
+
+    if (dev == NULL) {
+        return;
+    }
+
+    switch (type) {
+    case G710P_REPORT_MEDIA_KEYS:
+        counter = &dev->stats.media_reports;
+        break;
+
+    case G710P_REPORT_G_KEYS:
+        counter = &dev->stats.g_reports;
+        break;
+
+    case G710P_REPORT_CNTRL_KEYS:
+        counter = &dev->stats.cntrl_reports;
+        break;
+
+    default:
+        counter = &dev->stats.unknown_reports;
+        decoded = 1;
+        break;
+    }
+
+    g710p_stats_count(decoded ? counter : &dev->stats.short_reports);
+}
+
+/**
+ * Decodes a raw input report. The control key reports carry the
+ * backlight levels, which refresh the cached levels of the device.
+ * The report is counted in the #g710p_stats of the device.
+ *
+ * @param dev The #g710p_device, or \c NULL.
+ * @param data The report data.
+ * @param size The size of the report data.
+ * @param report The #g710p_report.
+ * @return \c 1 if the report was decoded, otherwise \c 0.
+ */
+int
+g710p_report_decode(g710p_device_t *dev, const uint8_t *data, int size,
+                    g710p_report_t *report)
+{
+    int ret = 0;
+
+    if (size <= 0) {
         return 0;
     }
 
-    if (res < 2) {
+    if (size < 2) {
+        g710p_report_count(dev, data[0], 0);
         return 0;
     }
 
@@ -281,34 +698,258 @@ g710p_report_get(g710p_device_t *dev, g710p_report_t *report, int timeout)
 
     switch (report->type) {
     case G710P_REPORT_MEDIA_KEYS:
-        if (g710p_read_check(res, 2)) {
+        if (g710p_read_check(size, 2)) {
             report->media_keys = data[1];
-            return 1;
+            ret = 1;
         }
         break;
 
     case G710P_REPORT_G_KEYS:
-        if (g710p_read_check(res, 4)) {
+        if (g710p_read_check(size, 4)) {
             report->g_keys = (data[1] << 8) | data[2];
-            return 1;
+            ret = 1;
         }
         break;
 
     case G710P_REPORT_CNTRL_KEYS:
-        if (g710p_read_check(res, 8)) {
+        if (g710p_read_check(size, 8)) {
             report->kb_level = data[3];
             report->wasd_level = data[2];
-            return 1;
+            ret = 1;
+
+            if (dev != NULL) {
+                g710p_state_merge(&dev->cache, G710P_STATE_MASK_BL,
+                                  G710P_STATE_PACK_BL(data[3], data[2]));
+            }
+        }
+        break;
+    }
+
+    g710p_report_count(dev, report->type, ret);
+    return ret;
+}
+
+/**
+ * Populates a #g710p_report with a report read from the device. If
+ * \p timeout is \c -1, this function blocks until there is something
+ * to read. If \p timeout is \c 0, the function does not block.
+ *
+ * @param dev The #g710p_device.
+ * @param report The #g710p_report.
+ * @param timeout The timeout in milliseconds.
+ * @return \c 1 if the report was successfully read, otherwise \c 0.
+ */
+int
+g710p_report_get(g710p_device_t *dev, g710p_report_t *report, int timeout)
+{
+    int res;
+    uint8_t data[G710P_REPORT_SIZE];
+
+    assert(dev != NULL);
+    assert(report != NULL);
+
+    res = g710p_device_read(dev, data, timeout);
+    return g710p_report_decode(dev, data, res, report);
+}
+
+/**
+ * Populates an array of #g710p_report with every report queued by the
+ * device. This blocks at most once, for the first report, and then
+ * drains the queued reports without blocking, until either there are
+ * no more reports or \p max reports were read. The \p timeout behaves
+ * like it does for #g710p_report_get(). Reports which cannot be decoded
+ * are skipped.
+ *
+ * @param dev The #g710p_device.
+ * @param reports The array of #g710p_report.
+ * @param max The maximum number of reports to read.
+ * @param timeout The timeout in milliseconds.
+ * @return The number of reports read, or \c -1 if reading failed
+ *         before any report was read.
+ */
+int
+g710p_report_get_many(g710p_device_t *dev, g710p_report_t *reports,
+                      size_t max, int timeout)
+{
+    int res;
+    size_t count = 0;
+    uint8_t data[G710P_REPORT_SIZE];
+
+    assert(dev != NULL);
+    assert(reports != NULL);
+
+    while (count < max) {
+        res = g710p_device_read(dev, data, timeout);
+        timeout = 0;
+
+        if (res <= 0) {
+            if ((res < 0) && (count == 0)) {
+                return -1;
+            }
+
+            break;
         }
+
+        count += g710p_report_decode(dev, data, res, &reports[count]);
+    }
+
+    return count;
+}
+
+static size_t
+g710p_keys_diff(uint8_t type, uint16_t old, uint16_t new, uint64_t time,
+                g710p_key_event_t *events)
+{
+    int bit;
+    size_t count = 0;
+    uint16_t changed = old ^ new;
+
+    while (changed != 0) {
+        bit = __builtin_ctz(changed);
+        changed &= changed - 1;
+
+        events[count].time = time;
+        events[count].type = type;
+        events[count].pressed = (new >> bit) & 1;
+        events[count].key = 1 << bit;
+        count++;
+    }
+
+    return count;
+}
+
+/**
+ * Converts a report into press and release events of the individual
+ * keys. The pressed keys of the device are tracked by this function,
+ * so every report of the device should be passed through it, in the
+ * order they were read. Reports other than key reports produce no
+ * events.
+ *
+ * @param dev The #g710p_device.
+ * @param report The #g710p_report.
+ * @param time The monotonic time of the read in nanoseconds.
+ * @param events The array of at least #G710P_KEY_EVENTS_MAX
+ *               #g710p_key_event.
+ * @return The number of events.
+ */
+size_t
+g710p_report_events(g710p_device_t *dev, const g710p_report_t *report,
+                    uint64_t time, g710p_key_event_t *events)
+{
+    size_t count = 0;
+
+    assert(dev != NULL);
+    assert(report != NULL);
+    assert(events != NULL);
+
+    switch (report->type) {
+    case G710P_REPORT_MEDIA_KEYS:
+        count = g710p_keys_diff(report->type, dev->media_keys,
+                                report->media_keys, time, events);
+        dev->media_keys = report->media_keys;
+        break;
+
+    case G710P_REPORT_G_KEYS:
+        count = g710p_keys_diff(report->type, dev->g_keys,
+                                report->g_keys, time, events);
+        dev->g_keys = report->g_keys;
         break;
     }
 
-    return 0;
+    return count;
+}
+
+/**
+ * Reads a report from the device and converts it into press and
+ * release events, stamped with the time of the read. The \p timeout
+ * behaves like it does for #g710p_report_get().
+ *
+ * @param dev The #g710p_device.
+ * @param events The array of at least #G710P_KEY_EVENTS_MAX
+ *               #g710p_key_event.
+ * @param timeout The timeout in milliseconds.
+ * @return The number of events.
+ */
+size_t
+g710p_events_get(g710p_device_t *dev, g710p_key_event_t *events, int timeout)
+{
+    g710p_report_t report;
+
+    if (!g710p_report_get(dev, &report, timeout)) {
+        return 0;
+    }
+
+    return g710p_report_events(dev, &report, g710p_time_ns(), events);
+}
+
+/**
+ * Starts delivering the reports of a device to a callback. The reports
+ * are decoded straight from the buffers of several in-flight transfers,
+ * and delivered from within #g710p_async_dispatch(), in the thread
+ * which dispatches. Once started, #g710p_report_get() no longer returns
+ * reports for the device. This is only supported by the libusb library.
+ *
+ * @param dev The #g710p_device.
+ * @param func The #g710p_report_func_t.
+ * @param data The user defined data passed to \p func.
+ * @return \c 1 if the delivery was started, otherwise \c 0.
+ */
+int
+g710p_async_start(g710p_device_t *dev, g710p_report_func_t func, void *data)
+{
+    assert(dev != NULL);
+    assert(func != NULL);
+
+    if (dev->backend->async_start == NULL) {
+        return 0;
+    }
+
+    return dev->backend->async_start(dev->handle, dev, func, data);
+}
+
+/**
+ * Stops delivering the reports of a device to the callback set with
+ * #g710p_async_start(). The reports are then returned by
+ * #g710p_report_get() again.
+ *
+ * @param dev The #g710p_device.
+ */
+void
+g710p_async_stop(g710p_device_t *dev)
+{
+    assert(dev != NULL);
+
+    if (dev->backend->async_stop != NULL) {
+        dev->backend->async_stop(dev->handle);
+    }
+}
+
+/**
+ * Dispatches the pending reports of every device started with
+ * #g710p_async_start() to their callbacks. If \p timeout is \c -1,
+ * this function blocks until there is an event. If \p timeout is
+ * \c 0, the function does not block.
+ *
+ * @param timeout The timeout in milliseconds.
+ * @return \c 1 if the events were dispatched, otherwise \c 0.
+ */
+int
+g710p_async_dispatch(int timeout)
+{
+
+    if (g710p_backend_system.dispatch == NULL) {
+        return 0;
+    }
+
+    return g710p_backend_system.dispatch(timeout);
 }
 
 /**
  * Gets the backlight brightness levels of the keyboard. Where \c 0 is
- * the brightest and \c 4 is the darkest.
+ * the brightest and \c 4 is the darkest. The levels are answered from
+ * the cache of the device, which is seeded by the first call, updated
+ * by #g710p_backlight_set_levels(), and refreshed by every control key
+ * report. Use #g710p_refresh() to read the levels from the device.
  *
  * @param dev The #g710p_device.
  * @param kb The return location for the keyboard level.
@@ -319,6 +960,7 @@ int
 g710p_backlight_get_levels(g710p_device_t *dev, uint8_t *kb, uint8_t *wasd)
 {
     int res;
+    uint32_t cache;
 
     uint8_t data[4] = {
         G710P_REPORT_BL_LVLS,
@@ -327,19 +969,25 @@ g710p_backlight_get_levels(g710p_device_t *dev, uint8_t *kb, uint8_t *wasd)
         0x00
     };
 
-    assert(g710p_inited);
     assert(dev != NULL);
     assert(kb != NULL);
     assert(wasd != NULL);
 
-    res = hid_get_feature_report(dev->handle, data, sizeof data);
+    cache = __atomic_load_n(&dev->cache, __ATOMIC_ACQUIRE);
 
-    if (res != sizeof data) {
-        return 0;
+    if (!(cache & G710P_STATE_BL_LVLS)) {
+        res = g710p_io_get_feature(dev, data, sizeof data);
+
+        if (res != sizeof data) {
+            return 0;
+        }
+
+        cache = G710P_STATE_PACK_BL(data[2], data[1]);
+        g710p_state_merge(&dev->cache, G710P_STATE_MASK_BL, cache);
     }
 
-    *kb = data[2];
-    *wasd = data[1];
+    *kb = G710P_STATE_KB(cache);
+    *wasd = G710P_STATE_WASD(cache);
     return 1;
 }
 
@@ -364,18 +1012,27 @@ g710p_backlight_set_levels(g710p_device_t *dev, uint8_t kb, uint8_t wasd)
         0x00
     };
 
-    assert(g710p_inited);
     assert(dev != NULL);
     assert(kb <= 4);
     assert(wasd <= 4);
 
-    res = hid_send_feature_report(dev->handle, data, sizeof data);
-    return res == sizeof data;
+    res = g710p_io_send_feature(dev, data, sizeof data);
+
+    if (res != sizeof data) {
+        return 0;
+    }
+
+    g710p_state_merge(&dev->cache, G710P_STATE_MASK_BL,
+                      G710P_STATE_PACK_BL(kb, wasd));
+    return 1;
 }
 
 /**
  * Gets the LED states of the M keys. The keys with active LEDs are
- * returned via \p keys.
+ * returned via \p keys. The states are answered from the cache of the
+ * device, which is seeded by the first call, and updated by
+ * #g710p_mkeys_set_leds(). Use #g710p_refresh() to read the states
+ * from the device.
  *
  * @param dev The #g710p_device.
  * @param keys The return location for the active M keys.
@@ -385,23 +1042,30 @@ int
 g710p_mkeys_get_leds(g710p_device_t *dev, uint8_t *keys)
 {
     int res;
+    uint32_t cache;
 
     uint8_t data[2] = {
         G710P_REPORT_M_LEDS,
         0x00
     };
 
-    assert(g710p_inited);
     assert(dev != NULL);
     assert(keys != NULL);
 
-    res = hid_get_feature_report(dev->handle, data, sizeof data);
+    cache = __atomic_load_n(&dev->cache, __ATOMIC_ACQUIRE);
 
-    if (res != sizeof data) {
-        return 0;
+    if (!(cache & G710P_STATE_M_LEDS)) {
+        res = g710p_io_get_feature(dev, data, sizeof data);
+
+        if (res != sizeof data) {
+            return 0;
+        }
+
+        cache = G710P_STATE_PACK_LEDS(data[1]);
+        g710p_state_merge(&dev->cache, G710P_STATE_MASK_LEDS, cache);
     }
 
-    *keys = data[1];
+    *keys = G710P_STATE_LEDS(cache);
     return 1;
 }
 
@@ -422,9 +1086,123 @@ g710p_mkeys_set_leds(g710p_device_t *dev, uint8_t keys)
         keys
     };
 
-    assert(g710p_inited);
     assert(dev != NULL);
 
-    res = hid_send_feature_report(dev->handle, data, sizeof data);
-    return res == sizeof data;
+    res = g710p_io_send_feature(dev, data, sizeof data);
+
+    if (res != sizeof data) {
+        return 0;
+    }
+
+    g710p_state_merge(&dev->cache, G710P_STATE_MASK_LEDS,
+                      G710P_STATE_PACK_LEDS(keys));
+    return 1;
+}
+
+/**
+ * Refreshes the cached backlight levels and M key LED states of a
+ * device by reading them from the device. This is only needed when the
+ * states may have been changed by something other than this library,
+ * such as another process.
+ *
+ * @param dev The #g710p_device.
+ * @return \c 1 if the states were successfully refreshed, otherwise
+ *         \c 0.
+ */
+int
+g710p_refresh(g710p_device_t *dev)
+{
+    uint8_t keys;
+    uint8_t kb;
+    uint8_t wasd;
+
+    assert(dev != NULL);
+
+    __atomic_store_n(&dev->cache, 0, __ATOMIC_RELEASE);
+    return g710p_backlight_get_levels(dev, &kb, &wasd) &&
+           g710p_mkeys_get_leds(dev, &keys);
+}
+
+/**
+ * Stages the backlight brightness levels of the keyboard, without
+ * sending them. The staged levels are sent by #g710p_commit(), only if
+ * they differ from the levels last acknowledged by the device.
+ *
+ * @param dev The #g710p_device.
+ * @param kb The keyboard level.
+ * @param wasd The WASD level.
+ */
+void
+g710p_backlight_stage_levels(g710p_device_t *dev, uint8_t kb, uint8_t wasd)
+{
+    assert(dev != NULL);
+    assert(kb <= 4);
+    assert(wasd <= 4);
+
+    dev->staged &= ~G710P_STATE_MASK_BL;
+    dev->staged |= G710P_STATE_PACK_BL(kb, wasd);
+}
+
+/**
+ * Stages the LED states of the M keys, without sending them. The
+ * staged states are sent by #g710p_commit(), only if they differ from
+ * the states last acknowledged by the device.
+ *
+ * @param dev The #g710p_device.
+ * @param keys The active M keys.
+ */
+void
+g710p_mkeys_stage_leds(g710p_device_t *dev, uint8_t keys)
+{
+    assert(dev != NULL);
+
+    dev->staged &= ~G710P_STATE_MASK_LEDS;
+    dev->staged |= G710P_STATE_PACK_LEDS(keys);
+}
+
+/**
+ * Commits the staged states of a device. Only the feature reports
+ * whose staged value differs from the value last acknowledged by the
+ * device are sent, so committing unchanged states costs nothing. The
+ * states which failed to send remain staged for the next commit.
+ *
+ * @param dev The #g710p_device.
+ * @return \c 1 if the states were successfully committed, otherwise
+ *         \c 0.
+ */
+int
+g710p_commit(g710p_device_t *dev)
+{
+    int ret = 1;
+    uint32_t cache;
+    uint32_t staged;
+
+    assert(dev != NULL);
+
+    cache = __atomic_load_n(&dev->cache, __ATOMIC_ACQUIRE);
+    staged = dev->staged;
+
+    if (staged & G710P_STATE_BL_LVLS) {
+        if (((cache ^ staged) & G710P_STATE_MASK_BL) == 0) {
+            dev->staged &= ~G710P_STATE_MASK_BL;
+        } else if (g710p_backlight_set_levels(dev, G710P_STATE_KB(staged),
+                                              G710P_STATE_WASD(staged)))
+        {
+            dev->staged &= ~G710P_STATE_MASK_BL;
+        } else {
+            ret = 0;
+        }
+    }
+
+    if (staged & G710P_STATE_M_LEDS) {
+        if (((cache ^ staged) & G710P_STATE_MASK_LEDS) == 0) {
+            dev->staged &= ~G710P_STATE_MASK_LEDS;
+        } else if (g710p_mkeys_set_leds(dev, G710P_STATE_LEDS(staged))) {
+            dev->staged &= ~G710P_STATE_MASK_LEDS;
+        } else {
+            ret = 0;
+        }
+    }
+
+    return ret;
 }
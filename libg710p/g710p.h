@@ -20,6 +20,7 @@
 #ifndef _G710P_H_
 #define _G710P_H_
 
+#include <stddef.h>
 #include <stdint.h>
 #include <wchar.h>
 
@@ -37,6 +38,9 @@ extern "C" {
 #define G710P_REPORT_M_LEDS  0x06  /**< The M keys LED report type. */
 #define G710P_REPORT_BL_LVLS  0x08  /**< The backlight levels report type. */
 
+#define G710P_KEY_EVENTS_MAX  16  /**< The maximum key events of a report. */
+#define G710P_STATS_BUCKETS  32  /**< The buckets of a latency histogram. */
+
 #define G710P_KEY_NEXT  (1 << 0)  /**< The next key for media. */
 #define G710P_KEY_PREV  (1 << 1)  /**< The previous key for media. */
 #define G710P_KEY_STOP  (1 << 2)  /**< The stop key for media. */
@@ -60,12 +64,58 @@ extern "C" {
 #define G710P_KEY_G6  (1 << 13)  /**< The G6 key. */
 
 
+/** Library context owning the backend initialization. */
+typedef struct g710p_context g710p_context_t;
+
 /** Device handle of a supported device. */
 typedef struct g710p_device g710p_device_t;
 
 /** Report for a keyboard event. */
 typedef struct g710p_report g710p_report_t;
 
+/** io_uring based reader of many devices. */
+typedef struct g710p_uring g710p_uring_t;
+
+/** Report of a device read by a #g710p_uring. */
+typedef struct g710p_uring_event g710p_uring_event_t;
+
+/** Report read by the reader thread of a device. */
+typedef struct g710p_timed_report g710p_timed_report_t;
+
+/** Press or release of a single key. */
+typedef struct g710p_key_event g710p_key_event_t;
+
+/** Monitor of supported devices being added and removed. */
+typedef struct g710p_hotplug g710p_hotplug_t;
+
+/** Statistics of a device operation. */
+typedef struct g710p_stats_op g710p_stats_op_t;
+
+/** Statistics of a device. */
+typedef struct g710p_stats g710p_stats_t;
+
+/**
+ * Callback for reports delivered by #g710p_async_start().
+ *
+ * @param dev The #g710p_device.
+ * @param report The #g710p_report.
+ * @param data The user defined data.
+ */
+typedef void (*g710p_report_func_t) (g710p_device_t *dev,
+                                     const g710p_report_t *report,
+                                     void *data);
+
+/**
+ * Callback for devices added and removed, as monitored by a
+ * #g710p_hotplug.
+ *
+ * @param path The path of the device.
+ * @param added \c 1 if the device was added, \c 0 if removed.
+ * @param data The user defined data.
+ */
+typedef void (*g710p_hotplug_func_t) (const char *path, int added,
+                                      void *data);
+
 
 /**
  * Report for a keyboard event.
@@ -79,6 +129,77 @@ struct g710p_report
     uint8_t wasd_level;  /**< The WASD backlight level. */
 };
 
+/**
+ * Report of a device read by a #g710p_uring.
+ */
+struct g710p_uring_event
+{
+    g710p_device_t *dev;  /**< The #g710p_device of the report. */
+    g710p_report_t report;  /**< The #g710p_report. */
+    int error;  /**< The \c errno of a failed read, or \c 0. */
+};
+
+/**
+ * Report read by the reader thread of a device.
+ */
+struct g710p_timed_report
+{
+    uint64_t time;  /**< The monotonic time of the read in nanoseconds. */
+    g710p_report_t report;  /**< The #g710p_report. */
+};
+
+/**
+ * Press or release of a single key. As the media keys share their bits
+ * with the G and M keys, the key is only unique along with the report
+ * type.
+ */
+struct g710p_key_event
+{
+    uint64_t time;  /**< The monotonic time of the read in nanoseconds. */
+    uint8_t type;  /**< The report type of the key. */
+    uint8_t pressed;  /**< \c 1 if the key was pressed, otherwise \c 0. */
+    uint16_t key;  /**< The key, one of the \c G710P_KEY_* bits. */
+};
+
+/**
+ * Statistics of a device operation. The latencies of the successful
+ * operations are kept in a histogram with logarithmic buckets, where
+ * bucket \c i counts the latencies of at least \c 2^i nanoseconds and
+ * below \c 2^(i+1) nanoseconds. The last bucket also counts every
+ * longer latency.
+ */
+struct g710p_stats_op
+{
+    uint64_t count;  /**< The number of successful operations. */
+    uint64_t errors;  /**< The number of failed or short operations. */
+    uint64_t total_ns;  /**< The total latency in nanoseconds. */
+    uint64_t max_ns;  /**< The maximum latency in nanoseconds. */
+    uint64_t buckets[G710P_STATS_BUCKETS];  /**< The latency histogram. */
+};
+
+/**
+ * Statistics of a device. Blocking reads wait for the user to press a
+ * key, so the read latencies are mostly useful for non-blocking reads.
+ * The feature report operations are kept apart per report type, as the
+ * backlight and M keys LED reports are handled separately by the
+ * keyboard.
+ */
+struct g710p_stats
+{
+    g710p_stats_op_t read;  /**< The input report reads. */
+    g710p_stats_op_t get_bl_lvls;  /**< The backlight levels reads. */
+    g710p_stats_op_t send_bl_lvls;  /**< The backlight levels writes. */
+    g710p_stats_op_t get_m_leds;  /**< The M keys LED reads. */
+    g710p_stats_op_t send_m_leds;  /**< The M keys LED writes. */
+    uint64_t read_timeouts;  /**< The number of blocking read timeouts. */
+
+    uint64_t media_reports;  /**< The number of media key reports. */
+    uint64_t g_reports;  /**< The number of G key reports. */
+    uint64_t cntrl_reports;  /**< The number of control key reports. */
+    uint64_t short_reports;  /**< The number of reports of a bad size. */
+    uint64_t unknown_reports;  /**< The number of reports of unknown type. */
+};
+
 
 int
 g710p_init(void);
@@ -86,6 +207,18 @@ g710p_init(void);
 int
 g710p_exit(void);
 
+g710p_context_t *
+g710p_context_new(void);
+
+int
+g710p_context_free(g710p_context_t *ctx);
+
+char **
+g710p_context_list_get(g710p_context_t *ctx);
+
+g710p_device_t *
+g710p_context_open(g710p_context_t *ctx, const char *path);
+
 const wchar_t *
 g710p_error(g710p_device_t *dev);
 
@@ -101,9 +234,59 @@ g710p_open(const char *path);
 void
 g710p_close(g710p_device_t *dev);
 
+int
+g710p_fd(g710p_device_t *dev);
+
+int
+g710p_wait_any(g710p_device_t **devs, size_t n, int *ready, int timeout);
+
 int
 g710p_report_get(g710p_device_t *dev, g710p_report_t *report, int timeout);
 
+int
+g710p_report_get_many(g710p_device_t *dev, g710p_report_t *reports,
+                      size_t max, int timeout);
+
+size_t
+g710p_report_events(g710p_device_t *dev, const g710p_report_t *report,
+                     uint64_t time, g710p_key_event_t *events);
+
+size_t
+g710p_events_get(g710p_device_t *dev, g710p_key_event_t *events, int timeout);
+
+uint64_t
+g710p_time_ns(void);
+
+void
+g710p_stats_get(g710p_device_t *dev, g710p_stats_t *stats);
+
+void
+g710p_stats_reset(g710p_device_t *dev);
+
+g710p_hotplug_t *
+g710p_hotplug_new(g710p_hotplug_func_t func, void *data);
+
+void
+g710p_hotplug_free(g710p_hotplug_t *hp);
+
+int
+g710p_hotplug_fd(g710p_hotplug_t *hp);
+
+char **
+g710p_hotplug_devices(g710p_hotplug_t *hp);
+
+int
+g710p_hotplug_dispatch(g710p_hotplug_t *hp, int timeout);
+
+int
+g710p_async_start(g710p_device_t *dev, g710p_report_func_t func, void *data);
+
+void
+g710p_async_stop(g710p_device_t *dev);
+
+int
+g710p_async_dispatch(int timeout);
+
 int
 g710p_backlight_get_levels(g710p_device_t *dev, uint8_t *kb, uint8_t *wasd);
 
@@ -116,6 +299,73 @@ g710p_mkeys_get_leds(g710p_device_t *dev, uint8_t *keys);
 int
 g710p_mkeys_set_leds(g710p_device_t *dev, uint8_t keys);
 
+int
+g710p_refresh(g710p_device_t *dev);
+
+void
+g710p_backlight_stage_levels(g710p_device_t *dev, uint8_t kb, uint8_t wasd);
+
+void
+g710p_mkeys_stage_leds(g710p_device_t *dev, uint8_t keys);
+
+int
+g710p_commit(g710p_device_t *dev);
+
+int
+g710p_writer_start(g710p_device_t *dev);
+
+void
+g710p_writer_stop(g710p_device_t *dev);
+
+void
+g710p_writer_set_rate(g710p_device_t *dev, unsigned int hz);
+
+int
+g710p_reader_start(g710p_device_t *dev);
+
+void
+g710p_reader_stop(g710p_device_t *dev);
+
+size_t
+g710p_reader_pop(g710p_device_t *dev, g710p_timed_report_t *reports,
+                 size_t max);
+
+void
+g710p_backlight_post_levels(g710p_device_t *dev, uint8_t kb, uint8_t wasd);
+
+void
+g710p_mkeys_post_leds(g710p_device_t *dev, uint8_t keys);
+
+g710p_uring_t *
+g710p_uring_new(unsigned int devices);
+
+void
+g710p_uring_free(g710p_uring_t *ring);
+
+int
+g710p_uring_add(g710p_uring_t *ring, g710p_device_t *dev);
+
+int
+g710p_uring_backlight_set_levels(g710p_uring_t *ring, g710p_device_t *dev,
+                                 uint8_t kb, uint8_t wasd);
+
+int
+g710p_uring_mkeys_set_leds(g710p_uring_t *ring, g710p_device_t *dev,
+                           uint8_t keys);
+
+int
+g710p_uring_wait(g710p_uring_t *ring, g710p_uring_event_t *events,
+                 size_t max, int timeout);
+
+g710p_device_t *
+g710p_mock_open(void);
+
+int
+g710p_mock_report_add(g710p_device_t *dev, const uint8_t *data, size_t size);
+
+void
+g710p_mock_set_repeat(g710p_device_t *dev, int repeat);
+
 #ifdef  __cplusplus
 }
 #endif /* __cplusplus */
@@ -0,0 +1,537 @@
+/*
+ * Copyright 2016 James Geboski <jgeboski@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <argp.h>
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "g710p-tools-common.h"
+
+
+#define FRAMES_MAX  1024
+#define KEYFRAMES_MAX  8
+#define LEVEL_MAX  4
+#define PERIOD_DEFAULT  3000
+#define PERIOD_MIN  10
+#define NSEC_PER_SEC  1000000000ULL
+#define NSEC_PER_MSEC  1000000ULL
+
+
+typedef enum effect effect_t;
+typedef struct frame frame_t;
+typedef struct keyframe keyframe_t;
+typedef struct timeline timeline_t;
+typedef struct user_data user_data_t;
+
+
+enum effect
+{
+    EFFECT_BREATHING,
+    EFFECT_CHASE,
+    EFFECT_FADE,
+    EFFECT_PULSE,
+    EFFECT_STATIC
+};
+
+/* The keyframes hold brightnesses, where 0 is off, as the levels of the
+ * keyboard are the other way around, where 0 is the brightest.
+ */
+struct keyframe
+{
+    uint32_t time;
+    uint8_t kb_brightness;
+    uint8_t wasd_brightness;
+    uint8_t m_keys;
+    int ease;
+};
+
+/* A change of the output, timed in milliseconds from the cycle start */
+struct frame
+{
+    uint32_t time;
+    uint8_t kb_level;
+    uint8_t wasd_level;
+    uint8_t m_keys;
+};
+
+struct timeline
+{
+    uint32_t period;
+    int loop;
+    int levels;
+    int leds;
+    size_t wrap;
+    size_t count;
+    frame_t frames[FRAMES_MAX];
+};
+
+struct user_data
+{
+    g710p_tools_device_t *tdevs;
+    int client;
+    effect_t effect;
+    unsigned int period;
+    unsigned int level;
+    int verbose;
+};
+
+
+const char *argp_program_version = PACKAGE_STRING;
+const char *argp_program_bug_address = PACKAGE_BUGREPORT;
+
+static int quit = 0;
+
+
+static void
+sighandler(int signal)
+{
+    quit = 1;
+}
+
+static uint8_t
+keyframe_lerp(uint8_t a, uint8_t b, double u)
+{
+    return floor(a + (b - a) * u + 0.5);
+}
+
+static int
+frame_equal(const frame_t *a, const frame_t *b)
+{
+    return (a->kb_level == b->kb_level) &&
+           (a->wasd_level == b->wasd_level) &&
+           (a->m_keys == b->m_keys);
+}
+
+/* Samples the keyframes every millisecond, keeping only the frames
+ * which change the output. The levels only have five steps, so a long
+ * and smooth animation compiles down to a handful of frames.
+ */
+static void
+timeline_compile(timeline_t *tl, const keyframe_t *keys, size_t count)
+{
+    const keyframe_t *a;
+    const keyframe_t *b;
+    double u;
+    frame_t frame;
+    size_t k = 0;
+    uint32_t time;
+
+    assert(count > 0);
+    tl->count = 0;
+
+    for (time = 0; (time < tl->period) || (time == 0); time++) {
+        while (((k + 1) < count) && (keys[k + 1].time <= time)) {
+            k++;
+        }
+
+        a = &keys[k];
+        b = ((k + 1) < count) ? &keys[k + 1] : a;
+        u = (b->time > a->time) ?
+            (double) (time - a->time) / (b->time - a->time) : 0.0;
+
+        if (a->ease) {
+            u = (1.0 - cos(M_PI * u)) / 2.0;
+        }
+
+        frame.time = time;
+        frame.kb_level = LEVEL_MAX - keyframe_lerp(a->kb_brightness,
+                                                   b->kb_brightness, u);
+        frame.wasd_level = LEVEL_MAX - keyframe_lerp(a->wasd_brightness,
+                                                     b->wasd_brightness, u);
+        frame.m_keys = a->m_keys;
+
+        if ((tl->count > 0) && frame_equal(&tl->frames[tl->count - 1],
+                                           &frame))
+        {
+            continue;
+        }
+
+        if (tl->count >= FRAMES_MAX) {
+            break;
+        }
+
+        tl->frames[tl->count++] = frame;
+    }
+
+    /* A loop skips its first frame when the last frame already matches */
+    tl->wrap = 0;
+
+    if ((tl->count > 1) && frame_equal(&tl->frames[0],
+                                       &tl->frames[tl->count - 1]))
+    {
+        tl->wrap = 1;
+    }
+}
+
+static void
+timeline_build(timeline_t *tl, const user_data_t *udata)
+{
+    keyframe_t keys[KEYFRAMES_MAX];
+    size_t count = 0;
+    uint32_t period = udata->period;
+    uint8_t peak = LEVEL_MAX - udata->level;
+    unsigned int i;
+
+    memset(keys, 0, sizeof keys);
+    tl->period = period;
+    tl->loop = 1;
+    tl->levels = 1;
+    tl->leds = 0;
+
+    switch (udata->effect) {
+    case EFFECT_BREATHING:
+        keys[1].time = period / 2;
+        keys[1].kb_brightness = peak;
+        keys[1].wasd_brightness = peak;
+        keys[2].time = period;
+        keys[0].ease = keys[1].ease = 1;
+        count = 3;
+        break;
+
+    case EFFECT_CHASE:
+        for (i = 0; i < 4; i++) {
+            keys[i].time = period * i / 4;
+            keys[i].m_keys = G710P_KEY_M1 << i;
+        }
+
+        tl->levels = 0;
+        tl->leds = 1;
+        count = 4;
+        break;
+
+    case EFFECT_FADE:
+        /* The levels are unknown through g710pd, so fade in from off */
+        if (udata->tdevs != NULL) {
+            keys[0].kb_brightness = LEVEL_MAX - udata->tdevs->kb_level;
+            keys[0].wasd_brightness = LEVEL_MAX - udata->tdevs->wasd_level;
+        }
+
+        keys[1].time = period;
+        keys[1].kb_brightness = peak;
+        keys[1].wasd_brightness = peak;
+        tl->loop = 0;
+        count = 2;
+        break;
+
+    case EFFECT_PULSE:
+        keys[0].kb_brightness = peak;
+        keys[0].wasd_brightness = peak;
+        keys[1].time = period * 3 / 5;
+        keys[2].time = period;
+        count = 3;
+        break;
+
+    case EFFECT_STATIC:
+        keys[0].kb_brightness = peak;
+        keys[0].wasd_brightness = peak;
+        tl->period = 0;
+        tl->loop = 0;
+        count = 1;
+        break;
+    }
+
+    timeline_compile(tl, keys, count);
+}
+
+static void
+frame_apply(const user_data_t *udata, const timeline_t *tl,
+            const frame_t *frame)
+{
+    g710p_tools_device_t *tdev;
+
+    if (udata->verbose) {
+        g710p_tools_println(
+            "Frame %u ms: Keyboard: %u, WASD: %u, M Keys: 0x%02x",
+            frame->time,
+            frame->kb_level,
+            frame->wasd_level,
+            frame->m_keys
+        );
+    }
+
+    if (udata->client != -1) {
+        if (tl->levels) {
+            g710p_tools_client_set_levels(udata->client, G710PD_DEVICE_ALL,
+                                          frame->kb_level, frame->wasd_level);
+        }
+
+        if (tl->leds) {
+            g710p_tools_client_set_leds(udata->client, G710PD_DEVICE_ALL,
+                                        frame->m_keys);
+        }
+
+        return;
+    }
+
+    for (tdev = udata->tdevs; tdev != NULL; tdev = tdev->next) {
+        if (tl->levels) {
+            g710p_backlight_stage_levels(tdev->dev, frame->kb_level,
+                                         frame->wasd_level);
+        }
+
+        if (tl->leds) {
+            g710p_mkeys_stage_leds(tdev->dev, frame->m_keys);
+        }
+
+        g710p_commit(tdev->dev);
+    }
+}
+
+static int
+timer_arm(int fd, uint64_t time)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof its);
+    its.it_value.tv_sec = time / NSEC_PER_SEC;
+    its.it_value.tv_nsec = time % NSEC_PER_SEC;
+    return timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) == 0;
+}
+
+static int
+timeline_play(const user_data_t *udata, const timeline_t *tl, int tfd)
+{
+    const frame_t *last;
+    g710pd_msg_t msg;
+    size_t idx = 0;
+    struct pollfd pfds[2];
+    uint64_t cycle;
+    uint64_t due;
+    uint64_t expirations;
+    uint64_t now;
+
+    /* The messages of g710pd are only read to notice it going away */
+    pfds[0].fd = tfd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = udata->client;
+    pfds[1].events = POLLIN;
+    cycle = g710p_time_ns();
+
+    while (!quit) {
+        now = g710p_time_ns();
+        last = NULL;
+
+        /* Catch up on the frames due, only applying the latest of them */
+        for (;;) {
+            if (idx >= tl->count) {
+                if (!tl->loop) {
+                    break;
+                }
+
+                idx = tl->wrap;
+                cycle += tl->period * NSEC_PER_MSEC;
+            }
+
+            due = cycle + tl->frames[idx].time * NSEC_PER_MSEC;
+
+            if (due > now) {
+                break;
+            }
+
+            last = &tl->frames[idx++];
+        }
+
+        if (last != NULL) {
+            frame_apply(udata, tl, last);
+        }
+
+        /* Sleep until the next change, or only for a signal once done */
+        if ((idx < tl->count) &&
+            !timer_arm(tfd, cycle + tl->frames[idx].time * NSEC_PER_MSEC))
+        {
+            g710p_tools_errorln("Failed to arm timer: %s", strerror(errno));
+            return 0;
+        }
+
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            g710p_tools_errorln("Failed to poll: %s", strerror(errno));
+            return 0;
+        }
+
+        if ((pfds[1].revents != 0) &&
+            !g710p_tools_client_recv(udata->client, &msg))
+        {
+            g710p_tools_errorln("Lost connection to g710pd");
+            return 0;
+        }
+
+        if ((pfds[0].revents & POLLIN) &&
+            (read(tfd, &expirations, sizeof expirations) < 0))
+        {
+            continue;
+        }
+    }
+
+    return 1;
+}
+
+static error_t
+parse_opt(int key, char *arg, struct argp_state *state)
+{
+    user_data_t *udata = state->input;
+
+    static const char *const effects[] = {
+        [EFFECT_BREATHING] = "breathing",
+        [EFFECT_CHASE] = "chase",
+        [EFFECT_FADE] = "fade",
+        [EFFECT_PULSE] = "pulse",
+        [EFFECT_STATIC] = "static"
+    };
+
+    unsigned int i;
+
+    switch (key) {
+    case 'e':
+        for (i = 0; i < (sizeof effects / sizeof *effects); i++) {
+            if (strcmp(arg, effects[i]) == 0) {
+                udata->effect = i;
+                return 0;
+            }
+        }
+
+        argp_error(state, "Invalid effect: %s", arg);
+        break;
+
+    case 'l':
+        udata->level = atoi(arg);
+
+        if (udata->level > LEVEL_MAX) {
+            udata->level = LEVEL_MAX;
+        }
+        break;
+
+    case 'p':
+        udata->period = atoi(arg);
+
+        if (udata->period < PERIOD_MIN) {
+            udata->period = PERIOD_MIN;
+        }
+        break;
+
+    case 'v':
+        udata->verbose = 1;
+        break;
+
+    case ARGP_KEY_INIT:
+        udata->effect = EFFECT_BREATHING;
+        udata->period = PERIOD_DEFAULT;
+        udata->level = 0;
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+static void
+outputs_close(user_data_t *udata)
+{
+    if (udata->client != -1) {
+        g710p_tools_client_close(udata->client);
+    } else {
+        g710p_tools_devices_close(udata->tdevs);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    int ret = EXIT_FAILURE;
+    int tfd;
+    timeline_t *tl;
+    user_data_t udata;
+
+    static const struct argp_option options[] = {
+        {"effect", 'e', "EFFECT", 0, "Effect to play (breathing, chase, "
+         "fade, pulse, static)", 0},
+        {"level", 'l', "LEVEL", 0, "Peak or target level, where 0 is the "
+         "brightest (Default: 0)", 0},
+        {"period", 'p', "MSEC", 0, "Period of the effect (Default: 3000)", 0},
+        {"verbose", 'v', NULL, 0, "Verbosely print additional messages", 0},
+        {NULL}
+    };
+
+    static const struct argp argp = {
+        options,
+        parse_opt,
+        NULL,
+        "Plays lighting effects on the G710+ backlight and M key LEDs",
+        NULL,
+        NULL,
+        NULL
+    };
+
+    memset(&udata, 0, sizeof udata);
+    argp_parse(&argp, argc, argv, 0, NULL, &udata);
+
+    /* Share the keyboards through g710pd when it is running */
+    udata.client = g710p_tools_client_connect(0, NULL);
+
+    if (udata.client == -1) {
+        udata.tdevs = g710p_tools_devices_open();
+
+        if (udata.tdevs == NULL) {
+            return EXIT_FAILURE;
+        }
+    } else if (udata.verbose) {
+        g710p_tools_println("Using g710pd");
+    }
+
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+
+    if (tfd == -1) {
+        g710p_tools_errorln("Failed to create timer: %s", strerror(errno));
+        outputs_close(&udata);
+        return EXIT_FAILURE;
+    }
+
+    /* Precompute the whole timeline before playing anything */
+    tl = malloc(sizeof *tl);
+    assert(tl != NULL);
+    timeline_build(tl, &udata);
+
+    if (udata.verbose) {
+        g710p_tools_println("Compiled %zu frames", tl->count);
+    }
+
+    signal(SIGINT, sighandler);
+    signal(SIGTERM, sighandler);
+
+    if (timeline_play(&udata, tl, tfd)) {
+        ret = EXIT_SUCCESS;
+    }
+
+    free(tl);
+    close(tfd);
+    outputs_close(&udata);
+    return ret;
+}
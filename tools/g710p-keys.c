@@ -15,12 +15,18 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdlib.h>
 
 #include "g710p-tools-common.h"
 
 
+#define REPORTS_MAX  16
+
+
 static int quit = 0;
 
 
@@ -30,13 +36,68 @@ sighandler(int signal)
     quit = 1;
 }
 
-int
-main(int argc, const char *argv[])
+static void
+report_print(unsigned int n, const g710p_report_t *report)
 {
-    g710p_report_t report;
+    g710p_tools_println("Device %u:", n);
+    g710p_tools_println("  Report type: 0x%0x", report->type);
+    g710p_tools_println("  Media Keys: 0x%0x", report->media_keys);
+    g710p_tools_println("  G Keys: 0x%0x", report->g_keys);
+    g710p_tools_println("  Keyboard Level: %u", report->kb_level);
+    g710p_tools_println("  WASD Level: %u", report->wasd_level);
+    g710p_tools_println("");
+}
+
+static int
+event_toggles(const g710p_key_event_t *event)
+{
+    return (event->type == G710P_REPORT_G_KEYS) &&
+           event->pressed &&
+           (event->key & G710P_KEY_MASK_M);
+}
+
+static void
+report_handle(g710p_tools_device_t *tdev, unsigned int n,
+              const g710p_report_t *report, uint64_t time)
+{
+    g710p_key_event_t events[G710P_KEY_EVENTS_MAX];
+    size_t count;
+    size_t i;
+    uint8_t keys;
+
+    report_print(n, report);
+    count = g710p_report_events(tdev->dev, report, time, events);
+
+    for (i = 0; i < count; i++) {
+        if (!event_toggles(&events[i])) {
+            continue;
+        }
+
+        /* Answered from the cache of the device, without a transfer */
+        if (!g710p_mkeys_get_leds(tdev->dev, &keys)) {
+            g710p_tools_errorln("Failed to get LEDs for device %u", n);
+        }
+
+        keys ^= events[i].key;
+
+        if (!g710p_mkeys_set_leds(tdev->dev, keys)) {
+            g710p_tools_errorln("Failed to set LEDs for device %u", n);
+        }
+    }
+}
+
+static int
+devices_run(void)
+{
+    g710p_device_t **devs;
+    g710p_report_t reports[REPORTS_MAX];
     g710p_tools_device_t *tdev;
     g710p_tools_device_t *tdevs;
-    uint8_t keys;
+    int i;
+    int *ready;
+    int res;
+    uint64_t time;
+    unsigned int count;
     unsigned int n;
 
     tdevs = g710p_tools_devices_open();
@@ -45,40 +106,113 @@ main(int argc, const char *argv[])
         return EXIT_FAILURE;
     }
 
+    for (count = 0, tdev = tdevs; tdev != NULL; tdev = tdev->next) {
+        count++;
+    }
+
+    devs = malloc((sizeof *devs) * count);
+    ready = malloc((sizeof *ready) * count);
+    assert((devs != NULL) && (ready != NULL));
+
     for (n = 1, tdev = tdevs; tdev != NULL; n++, tdev = tdev->next) {
+        devs[n - 1] = tdev->dev;
+
         if (!g710p_backlight_set_levels(tdev->dev, 4, 0)) {
             g710p_tools_errorln("Failed to set backlight for device %u", n);
         }
     }
 
-    signal(SIGINT, sighandler);
-
     while (!quit) {
+        if (g710p_wait_any(devs, count, ready, -1) < 0) {
+            g710p_tools_errorln("Failed to wait for devices");
+            break;
+        }
+
         for (n = 1, tdev = tdevs; tdev != NULL; n++, tdev = tdev->next) {
-            if (!g710p_report_get(tdev->dev, &report, 100)) {
+            if (!ready[n - 1]) {
                 continue;
             }
 
-            g710p_tools_println("Device %u:", n);
-            g710p_tools_println("  Report type: 0x%0x", report.type);
-            g710p_tools_println("  Media Keys: 0x%0x", report.media_keys);
-            g710p_tools_println("  G Keys: 0x%0x", report.g_keys);
-            g710p_tools_println("  Keyboard Level: %u", report.kb_level);
-            g710p_tools_println("  WASD Level: %u", report.wasd_level);
-            g710p_tools_println("");
+            res = g710p_report_get_many(tdev->dev, reports, REPORTS_MAX, 0);
+            time = g710p_time_ns();
 
-            if (!g710p_mkeys_get_leds(tdev->dev, &keys)) {
-                g710p_tools_errorln("Failed to get LEDs for device %u", n);
+            for (i = 0; i < res; i++) {
+                report_handle(tdev, n, &reports[i], time);
             }
+        }
+    }
 
-            keys ^= report.g_keys & G710P_KEY_MASK_M;
+    free(devs);
+    free(ready);
+    g710p_tools_devices_close(tdevs);
+    return EXIT_SUCCESS;
+}
 
-            if (!g710p_mkeys_set_leds(tdev->dev, keys)) {
-                g710p_tools_errorln("Failed to set LEDs for device %u", n);
+/* The daemon merges the LEDs of its clients, so only the LEDs toggled
+ * by this client are kept, and they are dropped once it disconnects.
+ */
+static int
+client_run(int fd)
+{
+    g710p_key_event_t event;
+    g710p_report_t report;
+    g710pd_msg_t msg;
+    struct pollfd pfd;
+    uint8_t leds[G710PD_DEVICES_MAX] = {0};
+
+    g710p_tools_println("Using g710pd");
+    g710p_tools_client_set_levels(fd, G710PD_DEVICE_ALL, 4, 0);
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    while (!quit) {
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            break;
+        }
+
+        if (!g710p_tools_client_recv(fd, &msg)) {
+            g710p_tools_errorln("Lost connection to g710pd");
+            break;
+        }
+
+        if (msg.device >= G710PD_DEVICES_MAX) {
+            continue;
+        }
+
+        if (msg.type == G710PD_MSG_REPORT) {
+            g710p_tools_client_report(&msg, &report);
+            report_print(msg.device + 1, &report);
+        } else if (msg.type == G710PD_MSG_KEY) {
+            g710p_tools_client_key(&msg, &event);
+
+            if (event_toggles(&event)) {
+                leds[msg.device] ^= event.key;
+                g710p_tools_client_set_leds(fd, msg.device,
+                                            leds[msg.device]);
             }
         }
     }
 
-    g710p_tools_devices_close(tdevs);
+    g710p_tools_client_close(fd);
     return EXIT_SUCCESS;
 }
+
+int
+main(int argc, const char *argv[])
+{
+    int fd;
+
+    signal(SIGINT, sighandler);
+    fd = g710p_tools_client_connect(G710PD_SUB_REPORTS | G710PD_SUB_KEYS,
+                                    NULL);
+
+    if (fd != -1) {
+        return client_run(fd);
+    }
+
+    return devices_run();
+}
@@ -0,0 +1,814 @@
+/*
+ * Copyright 2016 James Geboski <jgeboski@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <argp.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/input.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "g710p-tools-common.h"
+
+
+#define BANKS  3
+#define G_KEYS  6
+#define KEYS_MAX  256
+#define MACRO_EVENTS  256
+#define PLAYERS_MAX  8
+#define REPORTS_MAX  16
+#define BATCH_MAX  64
+#define NSEC_PER_SEC  1000000000ULL
+#define NSEC_PER_USEC  1000ULL
+
+
+typedef struct macro macro_t;
+typedef struct macro_event macro_event_t;
+typedef struct player player_t;
+typedef struct user_data user_data_t;
+
+
+/* A compiled event, timed in microseconds from the start of the macro */
+struct macro_event
+{
+    uint32_t time;
+    uint16_t code;
+    uint16_t value;
+};
+
+struct macro
+{
+    size_t count;
+    macro_event_t events[MACRO_EVENTS];
+};
+
+struct player
+{
+    const macro_t *macro;
+    size_t idx;
+    uint64_t start;
+};
+
+struct user_data
+{
+    g710p_device_t **devs;
+    unsigned int count;
+    int client;
+    int verbose;
+    int priority;
+    const char *file;
+    const char *record;
+    int ufd;
+    int tfd;
+    int efd;
+
+    unsigned int bank;
+    int armed;
+    macro_t *recording;
+    uint64_t rec_start;
+    uint8_t held[KEYS_MAX / 8];
+    unsigned int held_count;
+
+    macro_t macros[BANKS][G_KEYS];
+    player_t players[PLAYERS_MAX];
+};
+
+
+const char *argp_program_version = PACKAGE_STRING;
+const char *argp_program_bug_address = PACKAGE_BUGREPORT;
+
+static int quit = 0;
+
+
+static void
+sighandler(int signal)
+{
+    quit = 1;
+}
+
+static void
+leds_update(user_data_t *udata)
+{
+    unsigned int i;
+    uint8_t keys;
+
+    keys = G710P_KEY_M1 << udata->bank;
+
+    if (udata->armed || (udata->recording != NULL)) {
+        keys |= G710P_KEY_MR;
+    }
+
+    if (udata->client != -1) {
+        g710p_tools_client_set_leds(udata->client, G710PD_DEVICE_ALL, keys);
+        return;
+    }
+
+    for (i = 0; i < udata->count; i++) {
+        if (udata->devs[i] != NULL) {
+            g710p_mkeys_post_leds(udata->devs[i], keys);
+        }
+    }
+}
+
+static int
+macros_load(user_data_t *udata)
+{
+    FILE *fp;
+    macro_t *macro;
+    unsigned int bank;
+    unsigned int code;
+    unsigned int gkey;
+    unsigned int value;
+    unsigned long time;
+
+    fp = fopen(udata->file, "r");
+
+    if (fp == NULL) {
+        return errno == ENOENT;
+    }
+
+    while (fscanf(fp, "%u %u %lu %u %u", &bank, &gkey, &time, &code,
+                  &value) == 5)
+    {
+        if ((bank < 1) || (bank > BANKS) || (gkey < 1) || (gkey > G_KEYS) ||
+            (code >= KEYS_MAX) || (value > 1))
+        {
+            continue;
+        }
+
+        macro = &udata->macros[bank - 1][gkey - 1];
+
+        if (macro->count < MACRO_EVENTS) {
+            macro->events[macro->count].time = time;
+            macro->events[macro->count].code = code;
+            macro->events[macro->count].value = value;
+            macro->count++;
+        }
+    }
+
+    fclose(fp);
+    return 1;
+}
+
+static void
+macros_save(user_data_t *udata)
+{
+    FILE *fp;
+    const macro_event_t *event;
+    const macro_t *macro;
+    size_t i;
+    unsigned int bank;
+    unsigned int gkey;
+
+    fp = fopen(udata->file, "w");
+
+    if (fp == NULL) {
+        g710p_tools_errorln("Failed to save %s: %s", udata->file,
+                            strerror(errno));
+        return;
+    }
+
+    for (bank = 0; bank < BANKS; bank++) {
+        for (gkey = 0; gkey < G_KEYS; gkey++) {
+            macro = &udata->macros[bank][gkey];
+
+            for (i = 0; i < macro->count; i++) {
+                event = &macro->events[i];
+                fprintf(fp, "%u %u %lu %u %u\n", bank + 1, gkey + 1,
+                        (unsigned long) event->time, event->code,
+                        event->value);
+            }
+        }
+    }
+
+    fclose(fp);
+}
+
+static void
+record_event(user_data_t *udata, const struct input_event *ev)
+{
+    macro_t *macro = udata->recording;
+    macro_event_t *event;
+    uint8_t bit;
+    uint64_t time;
+
+    /* Autorepeats are left to the host */
+    if ((ev->type != EV_KEY) || (ev->value > 1) || (ev->code >= KEYS_MAX)) {
+        return;
+    }
+
+    bit = 1 << (ev->code % 8);
+
+    /* Every press keeps room for its release, and the releases of the
+     * keys pressed before the recording started are dropped.
+     */
+    if (ev->value) {
+        if ((udata->held[ev->code / 8] & bit) ||
+            ((macro->count + udata->held_count + 2) > MACRO_EVENTS))
+        {
+            return;
+        }
+
+        udata->held[ev->code / 8] |= bit;
+        udata->held_count++;
+    } else {
+        if (!(udata->held[ev->code / 8] & bit)) {
+            return;
+        }
+
+        udata->held[ev->code / 8] &= ~bit;
+        udata->held_count--;
+    }
+
+    time = ev->input_event_sec * NSEC_PER_SEC +
+           ev->input_event_usec * NSEC_PER_USEC;
+    time = (time > udata->rec_start) ? (time - udata->rec_start) : 0;
+
+    event = &macro->events[macro->count++];
+    event->time = time / NSEC_PER_USEC;
+    event->code = ev->code;
+    event->value = ev->value;
+}
+
+static void
+record_dispatch(user_data_t *udata)
+{
+    ssize_t res;
+    size_t i;
+    struct input_event evs[BATCH_MAX];
+
+    for (;;) {
+        res = read(udata->efd, evs, sizeof evs);
+
+        if (res <= 0) {
+            break;
+        }
+
+        for (i = 0; (udata->recording != NULL) &&
+                    (i < (res / sizeof *evs)); i++)
+        {
+            record_event(udata, &evs[i]);
+        }
+    }
+}
+
+static void
+record_finish(user_data_t *udata)
+{
+    macro_t *macro = udata->recording;
+    macro_event_t *event;
+    uint32_t time = 0;
+    unsigned int code;
+
+    if (macro->count > 0) {
+        time = macro->events[macro->count - 1].time;
+    }
+
+    /* Compile in the releases of the keys still held */
+    for (code = 0; code < KEYS_MAX; code++) {
+        if (!(udata->held[code / 8] & (1 << (code % 8)))) {
+            continue;
+        }
+
+        assert(macro->count < MACRO_EVENTS);
+        event = &macro->events[macro->count++];
+        event->time = time;
+        event->code = code;
+        event->value = 0;
+    }
+
+    if (udata->verbose) {
+        g710p_tools_println("Recorded %zu events", macro->count);
+    }
+
+    udata->recording = NULL;
+
+    if (udata->file != NULL) {
+        macros_save(udata);
+    }
+}
+
+static void
+players_arm(user_data_t *udata)
+{
+    const player_t *player;
+    struct itimerspec its;
+    uint64_t next = 0;
+    uint64_t time;
+    unsigned int i;
+
+    for (i = 0; i < PLAYERS_MAX; i++) {
+        player = &udata->players[i];
+
+        if (player->macro == NULL) {
+            continue;
+        }
+
+        time = player->start +
+               player->macro->events[player->idx].time * NSEC_PER_USEC;
+
+        if ((next == 0) || (time < next)) {
+            next = time;
+        }
+    }
+
+    /* Absolute deadlines, so a late wakeup never delays the rest */
+    memset(&its, 0, sizeof its);
+    its.it_value.tv_sec = next / NSEC_PER_SEC;
+    its.it_value.tv_nsec = next % NSEC_PER_SEC;
+
+    if (timerfd_settime(udata->tfd, TFD_TIMER_ABSTIME, &its, NULL) != 0) {
+        g710p_tools_errorln("Failed to arm timer: %s", strerror(errno));
+    }
+}
+
+static void
+players_dispatch(user_data_t *udata)
+{
+    const macro_event_t *event;
+    player_t *player;
+    size_t size;
+    struct input_event evs[BATCH_MAX + 1];
+    uint64_t expirations;
+    uint64_t now;
+    unsigned int i;
+    unsigned int n = 0;
+
+    if (read(udata->tfd, &expirations, sizeof expirations) < 0) {
+        return;
+    }
+
+    now = g710p_time_ns();
+
+    for (i = 0; i < PLAYERS_MAX; i++) {
+        player = &udata->players[i];
+
+        while ((player->macro != NULL) && (n < BATCH_MAX)) {
+            event = &player->macro->events[player->idx];
+
+            if ((player->start + event->time * NSEC_PER_USEC) > now) {
+                break;
+            }
+
+            memset(&evs[n], 0, sizeof evs[n]);
+            evs[n].type = EV_KEY;
+            evs[n].code = event->code;
+            evs[n].value = event->value;
+            n++;
+
+            if (++player->idx >= player->macro->count) {
+                player->macro = NULL;
+            }
+        }
+    }
+
+    if (n > 0) {
+        memset(&evs[n], 0, sizeof evs[n]);
+        evs[n].type = EV_SYN;
+        evs[n].code = SYN_REPORT;
+        size = (sizeof *evs) * (n + 1);
+
+        if (write(udata->ufd, evs, size) != (ssize_t) size) {
+            g710p_tools_errorln("Failed to write events: %s",
+                                strerror(errno));
+        }
+    }
+
+    players_arm(udata);
+}
+
+static void
+macro_play(user_data_t *udata, const macro_t *macro, uint64_t time)
+{
+    unsigned int i;
+
+    if (macro->count == 0) {
+        return;
+    }
+
+    for (i = 0; i < PLAYERS_MAX; i++) {
+        if (udata->players[i].macro == NULL) {
+            udata->players[i].macro = macro;
+            udata->players[i].idx = 0;
+            udata->players[i].start = time;
+            players_arm(udata);
+            return;
+        }
+    }
+
+    g710p_tools_errorln("Too many macros playing, skipping");
+}
+
+static void
+key_handle(user_data_t *udata, const g710p_key_event_t *event)
+{
+    macro_t *macro;
+    unsigned int bit;
+
+    if ((event->type != G710P_REPORT_G_KEYS) || !event->pressed) {
+        return;
+    }
+
+    bit = __builtin_ctz(event->key);
+
+    switch (event->key) {
+    case G710P_KEY_M1:
+    case G710P_KEY_M2:
+    case G710P_KEY_M3:
+        udata->bank = bit - __builtin_ctz(G710P_KEY_M1);
+        udata->armed = 0;
+        break;
+
+    case G710P_KEY_MR:
+        if (udata->recording != NULL) {
+            record_finish(udata);
+        } else if (udata->efd == -1) {
+            g710p_tools_errorln("Recording requires --record");
+        } else {
+            udata->armed = !udata->armed;
+        }
+        break;
+
+    default:
+        if (!(event->key & G710P_KEY_MASK_G)) {
+            return;
+        }
+
+        bit -= __builtin_ctz(G710P_KEY_G1);
+        macro = &udata->macros[udata->bank][bit];
+
+        if (!udata->armed) {
+            if (udata->recording == NULL) {
+                macro_play(udata, macro, event->time);
+            }
+
+            return;
+        }
+
+        /* Drop the events read before the recording started */
+        record_dispatch(udata);
+        memset(udata->held, 0, sizeof udata->held);
+        udata->held_count = 0;
+        macro->count = 0;
+        udata->recording = macro;
+        udata->rec_start = g710p_time_ns();
+        udata->armed = 0;
+        break;
+    }
+
+    leds_update(udata);
+}
+
+static int
+device_dispatch(user_data_t *udata, g710p_device_t *dev)
+{
+    g710p_key_event_t events[G710P_KEY_EVENTS_MAX];
+    g710p_report_t reports[REPORTS_MAX];
+    int i;
+    int res;
+    size_t count;
+    size_t j;
+    uint64_t time;
+
+    res = g710p_report_get_many(dev, reports, REPORTS_MAX, 0);
+    time = g710p_time_ns();
+
+    for (i = 0; i < res; i++) {
+        count = g710p_report_events(dev, &reports[i], time, events);
+
+        for (j = 0; j < count; j++) {
+            key_handle(udata, &events[j]);
+        }
+    }
+
+    return res >= 0;
+}
+
+static int
+client_dispatch(user_data_t *udata)
+{
+    g710p_key_event_t event;
+    g710pd_msg_t msg;
+
+    if (!g710p_tools_client_recv(udata->client, &msg)) {
+        return 0;
+    }
+
+    if (msg.type == G710PD_MSG_KEY) {
+        g710p_tools_client_key(&msg, &event);
+        key_handle(udata, &event);
+    }
+
+    return 1;
+}
+
+static int
+realtime_setup(user_data_t *udata)
+{
+    struct sched_param param;
+
+    /* Page faults and timer slack would both cost the timing */
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        g710p_tools_errorln("Failed to lock memory: %s", strerror(errno));
+    }
+
+    prctl(PR_SET_TIMERSLACK, 1UL);
+
+    if (udata->priority == 0) {
+        return 1;
+    }
+
+    memset(&param, 0, sizeof param);
+    param.sched_priority = udata->priority;
+
+    if (sched_setscheduler(0, SCHED_FIFO, &param) != 0) {
+        g710p_tools_errorln("Failed to set priority: %s", strerror(errno));
+        return 0;
+    }
+
+    return 1;
+}
+
+static int
+record_open(user_data_t *udata)
+{
+    int clock = CLOCK_MONOTONIC;
+
+    if (udata->record == NULL) {
+        return 1;
+    }
+
+    udata->efd = open(udata->record, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+    if (udata->efd == -1) {
+        g710p_tools_errorln("Failed to open %s: %s", udata->record,
+                            strerror(errno));
+        return 0;
+    }
+
+    /* Time the events with the clock of the macros */
+    if (ioctl(udata->efd, EVIOCSCLOCKID, &clock) != 0) {
+        g710p_tools_errorln("Failed to set the clock of %s", udata->record);
+        return 0;
+    }
+
+    return 1;
+}
+
+static error_t
+parse_opt(int key, char *arg, struct argp_state *state)
+{
+    user_data_t *udata = state->input;
+
+    switch (key) {
+    case 'f':
+        udata->file = arg;
+        break;
+
+    case 'p':
+        udata->priority = atoi(arg);
+
+        if ((udata->priority < sched_get_priority_min(SCHED_FIFO)) ||
+            (udata->priority > sched_get_priority_max(SCHED_FIFO)))
+        {
+            argp_error(state, "Invalid priority: %s", arg);
+        }
+        break;
+
+    case 'r':
+        udata->record = arg;
+        break;
+
+    case 'v':
+        udata->verbose = 1;
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    g710p_tools_device_t *tdev;
+    g710p_tools_device_t *tdevs = NULL;
+    int ret = EXIT_FAILURE;
+    struct pollfd *pfds = NULL;
+    uint16_t codes[KEYS_MAX];
+    unsigned int i;
+    unsigned int live;
+    unsigned int n;
+    user_data_t *udata;
+
+    static const struct argp_option options[] = {
+        {"file", 'f', "FILE", 0, "Load and save the macros to FILE", 0},
+        {"priority", 'p', "PRIO", 0, "Play with the SCHED_FIFO priority", 0},
+        {"record", 'r', "DEVICE", 0, "Record the key events of DEVICE", 0},
+        {"verbose", 'v', NULL, 0, "Verbosely print additional messages", 0},
+        {NULL}
+    };
+
+    static const struct argp argp = {
+        options,
+        parse_opt,
+        NULL,
+        "Records and plays macros of the G710+ G keys via uinput",
+        NULL,
+        NULL,
+        NULL
+    };
+
+    /* The macros are preallocated, so nothing is allocated once running */
+    udata = calloc(1, sizeof *udata);
+    assert(udata != NULL);
+    udata->client = -1;
+    udata->ufd = -1;
+    udata->tfd = -1;
+    udata->efd = -1;
+    argp_parse(&argp, argc, argv, 0, NULL, udata);
+
+    if ((udata->file != NULL) && !macros_load(udata)) {
+        g710p_tools_errorln("Failed to load %s: %s", udata->file,
+                            strerror(errno));
+        goto cleanup;
+    }
+
+    for (i = 0; i < KEYS_MAX; i++) {
+        codes[i] = i;
+    }
+
+    udata->ufd = g710p_tools_uinput_open("Logitech G710+ Macros", codes,
+                                         KEYS_MAX);
+    udata->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if ((udata->ufd == -1) || (udata->tfd == -1) || !record_open(udata)) {
+        goto cleanup;
+    }
+
+    /* Share the keyboards through g710pd when it is running */
+    udata->client = g710p_tools_client_connect(G710PD_SUB_KEYS, NULL);
+
+    if (udata->client != -1) {
+        if (udata->verbose) {
+            g710p_tools_println("Using g710pd");
+        }
+    } else {
+        tdevs = g710p_tools_devices_open();
+
+        if (tdevs == NULL) {
+            goto cleanup;
+        }
+
+        for (tdev = tdevs; tdev != NULL; tdev = tdev->next) {
+            udata->count++;
+        }
+
+        udata->devs = malloc((sizeof *udata->devs) * udata->count);
+        assert(udata->devs != NULL);
+
+        for (i = 0, tdev = tdevs; tdev != NULL; i++, tdev = tdev->next) {
+            udata->devs[i] = tdev->dev;
+
+            if ((g710p_fd(tdev->dev) == -1) ||
+                !g710p_writer_start(tdev->dev))
+            {
+                g710p_tools_errorln("Failed to set up device %u", i + 1);
+                goto cleanup;
+            }
+        }
+    }
+
+    if (!realtime_setup(udata)) {
+        goto cleanup;
+    }
+
+    leds_update(udata);
+    signal(SIGINT, sighandler);
+    signal(SIGTERM, sighandler);
+
+    /* The connection to g710pd, or the devices, follow the timer and
+     * the recorded device */
+    n = 2 + ((udata->client != -1) ? 1 : udata->count);
+    pfds = malloc((sizeof *pfds) * n);
+    assert(pfds != NULL);
+    pfds[0].fd = udata->tfd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = udata->efd;
+    pfds[1].events = POLLIN;
+
+    if (udata->client != -1) {
+        pfds[2].fd = udata->client;
+        pfds[2].events = POLLIN;
+    }
+
+    for (i = 0; i < udata->count; i++) {
+        pfds[i + 2].fd = g710p_fd(udata->devs[i]);
+        pfds[i + 2].events = POLLIN;
+    }
+
+    live = udata->count;
+
+    while (!quit) {
+        if (poll(pfds, n, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            g710p_tools_errorln("Failed to poll: %s", strerror(errno));
+            goto cleanup;
+        }
+
+        /* The macros are played first, as they are the most sensitive */
+        if (pfds[0].revents & POLLIN) {
+            players_dispatch(udata);
+        }
+
+        if ((udata->client != -1) && (pfds[2].revents != 0) &&
+            !client_dispatch(udata))
+        {
+            g710p_tools_errorln("Lost connection to g710pd");
+            break;
+        }
+
+        /* A lost device stays readable, so it is dropped from the poll */
+        for (i = 0; i < udata->count; i++) {
+            if ((pfds[i + 2].revents & (POLLERR | POLLHUP)) ||
+                ((pfds[i + 2].revents & POLLIN) &&
+                 !device_dispatch(udata, udata->devs[i])))
+            {
+                g710p_tools_errorln("Lost device %u", i + 1);
+                pfds[i + 2].fd = -1;
+                udata->devs[i] = NULL;
+                live--;
+            }
+        }
+
+        if ((udata->client == -1) && (live == 0)) {
+            g710p_tools_errorln("Lost every device");
+            break;
+        }
+
+        if (pfds[1].revents & POLLIN) {
+            record_dispatch(udata);
+        }
+    }
+
+    ret = EXIT_SUCCESS;
+
+cleanup:
+    if (tdevs != NULL) {
+        g710p_tools_devices_close(tdevs);
+    }
+
+    if (udata->client != -1) {
+        g710p_tools_client_close(udata->client);
+    }
+
+    if (udata->ufd != -1) {
+        g710p_tools_uinput_close(udata->ufd);
+    }
+
+    if (udata->tfd != -1) {
+        close(udata->tfd);
+    }
+
+    if (udata->efd != -1) {
+        close(udata->efd);
+    }
+
+    free(pfds);
+    free(udata->devs);
+    free(udata);
+    return ret;
+}
@@ -0,0 +1,381 @@
+/*
+ * Copyright 2016 James Geboski <jgeboski@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define G710P_METER_AVX2
+#include <immintrin.h>
+#endif
+
+#include "g710p-meter.h"
+
+
+typedef size_t (*g710p_meter_kernel_t) (
+    const void *data,
+    size_t count,
+    g710p_meter_format_t format,
+    float *peak,
+    float *sum);
+
+
+static float
+g710p_meter_sample(const void *data, size_t idx, g710p_meter_format_t format)
+{
+    switch (format) {
+    case G710P_METER_FORMAT_U8:
+        return (float) ((const uint8_t *) data)[idx] - 128.0f;
+
+    case G710P_METER_FORMAT_S16:
+        return ((const int16_t *) data)[idx];
+
+    case G710P_METER_FORMAT_F32:
+        return ((const float *) data)[idx];
+    }
+
+    assert(0);
+    return 0.0f;
+}
+
+static float
+g710p_meter_scale(g710p_meter_format_t format)
+{
+    switch (format) {
+    case G710P_METER_FORMAT_U8:
+        return 1.0f / 128.0f;
+
+    case G710P_METER_FORMAT_S16:
+        return 1.0f / 32768.0f;
+
+    case G710P_METER_FORMAT_F32:
+        return 1.0f;
+    }
+
+    assert(0);
+    return 0.0f;
+}
+
+#if !defined(__SSE2__) && !defined(__ARM_NEON)
+static size_t
+g710p_meter_scalar(
+    const void *data,
+    size_t count,
+    g710p_meter_format_t format,
+    float *peak,
+    float *sum)
+{
+    /* Leaves every sample to the scalar loop of the caller */
+    return 0;
+}
+#endif /* !__SSE2__ && !__ARM_NEON */
+
+#if defined(__SSE2__)
+static inline void
+g710p_meter_sse2_acc(__m128 v, __m128 *peak, __m128 *sum)
+{
+    const __m128 sign = _mm_set1_ps(-0.0f);
+
+    *peak = _mm_max_ps(*peak, _mm_andnot_ps(sign, v));
+    *sum = _mm_add_ps(*sum, _mm_mul_ps(v, v));
+}
+
+static inline __m128
+g710p_meter_sse2_s32(__m128i lo, __m128i v)
+{
+    /* Sign extends the 16-bit lanes of an interleave into 32 bits */
+    return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(lo, v), 16));
+}
+
+static size_t
+g710p_meter_sse2(
+    const void *data,
+    size_t count,
+    g710p_meter_format_t format,
+    float *peak,
+    float *sum)
+{
+    const float *f32 = data;
+    const int16_t *s16 = data;
+    const uint8_t *u8 = data;
+    __m128 vpeak = _mm_setzero_ps();
+    __m128 vsum = _mm_setzero_ps();
+    __m128i v;
+    __m128i w;
+    float lanes[4];
+    size_t i = 0;
+    unsigned int j;
+
+    switch (format) {
+    case G710P_METER_FORMAT_U8:
+        for (; (i + 16) <= count; i += 16) {
+            /* Flip the bias of the samples into signed bytes */
+            v = _mm_loadu_si128((const __m128i *) (u8 + i));
+            v = _mm_xor_si128(v, _mm_set1_epi8((char) 0x80));
+
+            w = _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8);
+            g710p_meter_sse2_acc(g710p_meter_sse2_s32(w, w), &vpeak, &vsum);
+            w = _mm_unpackhi_epi64(w, w);
+            g710p_meter_sse2_acc(g710p_meter_sse2_s32(w, w), &vpeak, &vsum);
+
+            w = _mm_srai_epi16(_mm_unpackhi_epi8(v, v), 8);
+            g710p_meter_sse2_acc(g710p_meter_sse2_s32(w, w), &vpeak, &vsum);
+            w = _mm_unpackhi_epi64(w, w);
+            g710p_meter_sse2_acc(g710p_meter_sse2_s32(w, w), &vpeak, &vsum);
+        }
+        break;
+
+    case G710P_METER_FORMAT_S16:
+        for (; (i + 8) <= count; i += 8) {
+            v = _mm_loadu_si128((const __m128i *) (s16 + i));
+            g710p_meter_sse2_acc(g710p_meter_sse2_s32(v, v), &vpeak, &vsum);
+            v = _mm_unpackhi_epi64(v, v);
+            g710p_meter_sse2_acc(g710p_meter_sse2_s32(v, v), &vpeak, &vsum);
+        }
+        break;
+
+    case G710P_METER_FORMAT_F32:
+        for (; (i + 4) <= count; i += 4) {
+            g710p_meter_sse2_acc(_mm_loadu_ps(f32 + i), &vpeak, &vsum);
+        }
+        break;
+    }
+
+    _mm_storeu_ps(lanes, vpeak);
+
+    for (j = 0; j < 4; j++) {
+        *peak = fmaxf(*peak, lanes[j]);
+    }
+
+    _mm_storeu_ps(lanes, vsum);
+    *sum += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    return i;
+}
+#endif /* __SSE2__ */
+
+#if defined(__ARM_NEON)
+static inline void
+g710p_meter_neon_acc(float32x4_t v, float32x4_t *peak, float32x4_t *sum)
+{
+    *peak = vmaxq_f32(*peak, vabsq_f32(v));
+    *sum = vmlaq_f32(*sum, v, v);
+}
+
+static inline void
+g710p_meter_neon_s16(int16x8_t v, float32x4_t *peak, float32x4_t *sum)
+{
+    g710p_meter_neon_acc(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))),
+                         peak, sum);
+    g710p_meter_neon_acc(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))),
+                         peak, sum);
+}
+
+static size_t
+g710p_meter_neon(
+    const void *data,
+    size_t count,
+    g710p_meter_format_t format,
+    float *peak,
+    float *sum)
+{
+    const float *f32 = data;
+    const int16_t *s16 = data;
+    const uint8_t *u8 = data;
+    float32x4_t vpeak = vdupq_n_f32(0.0f);
+    float32x4_t vsum = vdupq_n_f32(0.0f);
+    float lanes[4];
+    int16x8_t v;
+    size_t i = 0;
+    unsigned int j;
+
+    switch (format) {
+    case G710P_METER_FORMAT_U8:
+        for (; (i + 8) <= count; i += 8) {
+            v = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(u8 + i)));
+            v = vsubq_s16(v, vdupq_n_s16(128));
+            g710p_meter_neon_s16(v, &vpeak, &vsum);
+        }
+        break;
+
+    case G710P_METER_FORMAT_S16:
+        for (; (i + 8) <= count; i += 8) {
+            v = vld1q_s16(s16 + i);
+            g710p_meter_neon_s16(v, &vpeak, &vsum);
+        }
+        break;
+
+    case G710P_METER_FORMAT_F32:
+        for (; (i + 4) <= count; i += 4) {
+            g710p_meter_neon_acc(vld1q_f32(f32 + i), &vpeak, &vsum);
+        }
+        break;
+    }
+
+    vst1q_f32(lanes, vpeak);
+
+    for (j = 0; j < 4; j++) {
+        *peak = fmaxf(*peak, lanes[j]);
+    }
+
+    vst1q_f32(lanes, vsum);
+    *sum += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    return i;
+}
+#endif /* __ARM_NEON */
+
+#if defined(G710P_METER_AVX2)
+__attribute__((target("avx2")))
+static size_t
+g710p_meter_avx2(
+    const void *data,
+    size_t count,
+    g710p_meter_format_t format,
+    float *peak,
+    float *sum)
+{
+    const float *f32 = data;
+    const int16_t *s16 = data;
+    const uint8_t *u8 = data;
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 v = _mm256_setzero_ps();
+    __m256 vpeak = _mm256_setzero_ps();
+    __m256 vsum = _mm256_setzero_ps();
+    __m128i w;
+    float lanes[8];
+    size_t i;
+    unsigned int j;
+
+    for (i = 0; (i + 8) <= count; i += 8) {
+        switch (format) {
+        case G710P_METER_FORMAT_U8:
+            w = _mm_loadl_epi64((const __m128i *) (u8 + i));
+            v = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_cvtepu8_epi32(w),
+                                                    _mm256_set1_epi32(128)));
+            break;
+
+        case G710P_METER_FORMAT_S16:
+            w = _mm_loadu_si128((const __m128i *) (s16 + i));
+            v = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(w));
+            break;
+
+        case G710P_METER_FORMAT_F32:
+            v = _mm256_loadu_ps(f32 + i);
+            break;
+        }
+
+        vpeak = _mm256_max_ps(vpeak, _mm256_andnot_ps(sign, v));
+        vsum = _mm256_add_ps(vsum, _mm256_mul_ps(v, v));
+    }
+
+    _mm256_storeu_ps(lanes, vpeak);
+
+    for (j = 0; j < 8; j++) {
+        *peak = fmaxf(*peak, lanes[j]);
+    }
+
+    _mm256_storeu_ps(lanes, vsum);
+
+    for (j = 0; j < 8; j++) {
+        *sum += lanes[j];
+    }
+
+    return i;
+}
+#endif /* G710P_METER_AVX2 */
+
+static g710p_meter_kernel_t
+g710p_meter_kernel(void)
+{
+    static g710p_meter_kernel_t kernel = NULL;
+
+    if (kernel != NULL) {
+        return kernel;
+    }
+
+#if defined(G710P_METER_AVX2)
+    if (__builtin_cpu_supports("avx2")) {
+        kernel = g710p_meter_avx2;
+        return kernel;
+    }
+#endif /* G710P_METER_AVX2 */
+
+#if defined(__SSE2__)
+    kernel = g710p_meter_sse2;
+#elif defined(__ARM_NEON)
+    kernel = g710p_meter_neon;
+#else
+    kernel = g710p_meter_scalar;
+#endif
+
+    return kernel;
+}
+
+size_t
+g710p_meter_sample_size(g710p_meter_format_t format)
+{
+    switch (format) {
+    case G710P_METER_FORMAT_U8:
+        return sizeof (uint8_t);
+
+    case G710P_METER_FORMAT_S16:
+        return sizeof (int16_t);
+
+    case G710P_METER_FORMAT_F32:
+        return sizeof (float);
+    }
+
+    assert(0);
+    return 0;
+}
+
+void
+g710p_meter_measure(
+    const void *data,
+    size_t count,
+    g710p_meter_format_t format,
+    g710p_meter_level_t *level)
+{
+    float peak = 0.0f;
+    float sample;
+    float scale;
+    float sum = 0.0f;
+    size_t i;
+
+    assert(data != NULL);
+    assert(level != NULL);
+
+    /* The kernel measures the bulk of the samples, leaving the tail */
+    i = g710p_meter_kernel()(data, count, format, &peak, &sum);
+
+    for (; i < count; i++) {
+        sample = g710p_meter_sample(data, i, format);
+        peak = fmaxf(peak, fabsf(sample));
+        sum += sample * sample;
+    }
+
+    scale = g710p_meter_scale(format);
+    level->peak = peak * scale;
+    level->rms = (count != 0) ? (sqrtf(sum / count) * scale) : 0.0f;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright 2016 James Geboski <jgeboski@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _G710P_METER_H_
+#define _G710P_METER_H_
+
+#include <stddef.h>
+
+
+typedef enum g710p_meter_format g710p_meter_format_t;
+typedef struct g710p_meter_level g710p_meter_level_t;
+
+
+enum g710p_meter_format
+{
+    G710P_METER_FORMAT_U8,
+    G710P_METER_FORMAT_S16,
+    G710P_METER_FORMAT_F32
+};
+
+struct g710p_meter_level
+{
+    float peak;
+    float rms;
+};
+
+
+size_t
+g710p_meter_sample_size(g710p_meter_format_t format);
+
+void
+g710p_meter_measure(
+    const void *data,
+    size_t count,
+    g710p_meter_format_t format,
+    g710p_meter_level_t *level);
+
+#endif /* _G710P_METER_H_ */
@@ -18,21 +18,24 @@
 #include <argp.h>
 #include <assert.h>
 #include <errno.h>
-#include <fcntl.h>
 #include <pulse/pulseaudio.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <unistd.h>
 
+#include "g710p-meter.h"
+#include "g710p-spectrum.h"
 #include "g710p-tools-common.h"
 
 
 #define LEVEL_CNT  5
 #define LEVEL_MAX  4
 #define PEAK_MIN  128
+#define RATE_DEFAULT  8000
+#define RATE_SPECTRUM  22050
+#define HIGH_MIN  0.5f
+#define WRITE_RATE  60
+#define FRAGMENT_DEFAULT  50
 
 
 typedef struct user_data user_data_t;
@@ -41,12 +44,20 @@ typedef struct user_data user_data_t;
 struct user_data
 {
     g710p_tools_device_t *tdevs;
+    int client;
     int daemonize;
     int verbose;
     pa_mainloop_api *mlapi;
     pa_stream *s;
     uint8_t peak_max;
     uint32_t idx;
+    uint32_t rate;
+    uint32_t fragment;
+    g710p_meter_format_t format;
+    int format_set;
+    int rms;
+    int spectrum;
+    g710p_spectrum_t *spec;
 };
 
 
@@ -55,9 +66,47 @@ const char *argp_program_bug_address = PACKAGE_BUGREPORT;
 
 
 static void
-keyboard_set_leds(g710p_tools_device_t *tdevs, uint8_t level)
+keyboard_set(
+    user_data_t *udata,
+    uint8_t kb,
+    uint8_t wasd,
+    uint8_t m_keys)
 {
     g710p_tools_device_t *tdev;
+
+    if (udata->client != -1) {
+        g710p_tools_client_set_leds(udata->client, G710PD_DEVICE_ALL, m_keys);
+        g710p_tools_client_set_levels(udata->client, G710PD_DEVICE_ALL,
+                                      kb, wasd);
+        return;
+    }
+
+    /* The writer threads send the levels, so this never waits on USB */
+    for (tdev = udata->tdevs; tdev != NULL; tdev = tdev->next) {
+        g710p_mkeys_post_leds(tdev->dev, m_keys);
+        g710p_backlight_post_levels(tdev->dev, kb, wasd);
+    }
+}
+
+static int
+keyboard_start_writers(g710p_tools_device_t *tdevs)
+{
+    g710p_tools_device_t *tdev;
+
+    for (tdev = tdevs; tdev != NULL; tdev = tdev->next) {
+        if (!g710p_writer_start(tdev->dev)) {
+            return 0;
+        }
+
+        g710p_writer_set_rate(tdev->dev, WRITE_RATE);
+    }
+
+    return 1;
+}
+
+static void
+keyboard_set_leds(user_data_t *udata, uint8_t level)
+{
     uint8_t m_keys = 0;
 
     assert(level <= 4);
@@ -78,22 +127,95 @@ keyboard_set_leds(g710p_tools_device_t *tdevs, uint8_t level)
         m_keys |= G710P_KEY_MR;
     }
 
-    for (tdev = tdevs; tdev != NULL; tdev = tdev->next) {
-        g710p_mkeys_set_leds(tdev->dev, m_keys);
-        g710p_backlight_set_levels(tdev->dev, level, level);
+    keyboard_set(udata, level, level, m_keys);
+}
+
+static void
+meter_set_leds(user_data_t *udata, const void *data, size_t len)
+{
+    float ceiling;
+    float value;
+    g710p_meter_level_t meter;
+    uint8_t level = LEVEL_MAX;
+
+    len /= g710p_meter_sample_size(udata->format);
+    g710p_meter_measure(data, len, udata->format, &meter);
+
+    ceiling = (float) (udata->peak_max - PEAK_MIN) / PEAK_MIN;
+    value = udata->rms ? meter.rms : meter.peak;
+
+    if (value > 0.0f) {
+        value = value * LEVEL_CNT / ceiling;
+        level = (value < LEVEL_MAX) ? (uint8_t) value : LEVEL_MAX;
+    }
+
+    if (udata->verbose) {
+        g710p_tools_println(
+            "Peak: %.3f, RMS: %.3f (Max: %.3f), Samples: %zu, Level: %u",
+            meter.peak,
+            meter.rms,
+            ceiling,
+            len,
+            level
+        );
+    }
+
+    keyboard_set_leds(udata, level);
+}
+
+static void
+spectrum_set_leds(user_data_t *udata, const void *data, size_t len)
+{
+    g710p_spectrum_levels_t levels;
+    uint8_t kb;
+    uint8_t m_keys = 0;
+    uint8_t wasd;
+    unsigned int i;
+
+    static const uint8_t highs[G710P_SPECTRUM_HIGHS] = {
+        G710P_KEY_M1,
+        G710P_KEY_M2,
+        G710P_KEY_M3,
+        G710P_KEY_MR
+    };
+
+    len /= sizeof (float);
+    g710p_spectrum_process(udata->spec, data, len, &levels);
+
+    /* Bass drives the WASD keys, and mids drive the other keys, where
+     * the lowest level is the brightest
+     */
+    wasd = LEVEL_MAX - (uint8_t) (levels.bass * LEVEL_MAX + 0.5f);
+    kb = LEVEL_MAX - (uint8_t) (levels.mids * LEVEL_MAX + 0.5f);
+
+    for (i = 0; i < G710P_SPECTRUM_HIGHS; i++) {
+        if (levels.highs[i] >= HIGH_MIN) {
+            m_keys |= highs[i];
+        }
+    }
+
+    if (udata->verbose) {
+        g710p_tools_println(
+            "Bass: %.2f, Mids: %.2f, Highs: %.2f %.2f %.2f %.2f",
+            levels.bass,
+            levels.mids,
+            levels.highs[0],
+            levels.highs[1],
+            levels.highs[2],
+            levels.highs[3]
+        );
     }
+
+    keyboard_set(udata, kb, wasd, m_keys);
 }
 
 static void
 stream_read_callback(pa_stream *s, size_t len, void *userdata)
 {
-    const uint8_t *data;
-    uint8_t level = LEVEL_MAX;
-    uint8_t sample;
-    uint8_t span;
+    const void *data;
     user_data_t *udata = userdata;
 
-    if (pa_stream_peek(s, (void *) &data, &len) < 0) {
+    if (pa_stream_peek(s, &data, &len) < 0) {
         g710p_tools_errorln("Failed to read stream");
         udata->mlapi->quit(udata->mlapi, EXIT_FAILURE);
         return;
@@ -107,27 +229,12 @@ stream_read_callback(pa_stream *s, size_t len, void *userdata)
         return;
     }
 
-    span = udata->peak_max - PEAK_MIN;
-    sample = data[len >> 1] - PEAK_MIN;
-
-    if (sample != 0) {
-        level = sample / (span / LEVEL_CNT);
-    }
-
-    if (level > LEVEL_MAX) {
-        level = LEVEL_MAX;
+    if (udata->spec != NULL) {
+        spectrum_set_leds(udata, data, len);
+    } else {
+        meter_set_leds(udata, data, len);
     }
 
-    if (udata->verbose) {
-        g710p_tools_println(
-            "Sample: %u (Max: %u), Level: %u",
-            sample,
-            span,
-            level
-        );
-    }
-
-    keyboard_set_leds(udata->tdevs, level);
     pa_stream_drop(s);
 }
 
@@ -136,26 +243,22 @@ context_state_callback(pa_context *ctx, void *userdata)
 {
     char dev[11];
     int res;
+    pa_buffer_attr attr;
     pa_context_state_t state;
+    pa_sample_spec ss;
     pa_stream *s;
     user_data_t *udata = userdata;
 
-    static const pa_buffer_attr attr = {
-        .maxlength = (uint32_t) -1,
-        .fragsize = sizeof (uint8_t)
-    };
-
-    static const pa_sample_spec ss = {
-        .format = PA_SAMPLE_U8,
-        .rate = 50,
-        .channels = 1
+    static const pa_sample_format_t formats[] = {
+        [G710P_METER_FORMAT_U8] = PA_SAMPLE_U8,
+        [G710P_METER_FORMAT_S16] = PA_SAMPLE_S16NE,
+        [G710P_METER_FORMAT_F32] = PA_SAMPLE_FLOAT32NE
     };
 
     static const pa_stream_flags_t flags =
         PA_STREAM_ADJUST_LATENCY |
         PA_STREAM_DONT_INHIBIT_AUTO_SUSPEND |
-        PA_STREAM_DONT_MOVE |
-        PA_STREAM_PEAK_DETECT;
+        PA_STREAM_DONT_MOVE;
 
     state = pa_context_get_state(ctx);
 
@@ -163,6 +266,16 @@ context_state_callback(pa_context *ctx, void *userdata)
         return;
     }
 
+    memset(&ss, 0, sizeof ss);
+    ss.format = formats[udata->format];
+    ss.rate = udata->rate;
+    ss.channels = 1;
+
+    /* Measure whole fragments, rather than waking for every sample */
+    memset(&attr, 0, sizeof attr);
+    attr.maxlength = (uint32_t) -1;
+    attr.fragsize = pa_usec_to_bytes(udata->fragment * PA_USEC_PER_MSEC, &ss);
+
     s = pa_stream_new(ctx, "Peak detector", &ss, NULL);
 
     if (s == NULL) {
@@ -192,38 +305,10 @@ signal_callback(
     mlapi->quit(mlapi, EXIT_SUCCESS);
 }
 
-static int
-daemonize(void)
-{
-    int fd;
-
-    switch (fork()) {
-    case 0:
-        break;
-
-    case -1:
-        return 0;
-
-    default:
-        exit(EXIT_SUCCESS);
-    }
-
-    fd = open("/dev/null", O_RDWR);
-
-    if (fd == -1) {
-        return 0;
-    }
-
-    return (setsid() != -1) &&
-           (chdir("/") != -1) &&
-           (dup2(fd, STDIN_FILENO) != -1) &&
-           (dup2(fd, STDOUT_FILENO) != -1) &&
-           (dup2(fd, STDERR_FILENO) != -1);
-}
-
 static error_t
 parse_opt(int key, char *arg, struct argp_state *state)
 {
+    int value;
     user_data_t *udata = state->input;
 
     switch (key) {
@@ -231,6 +316,25 @@ parse_opt(int key, char *arg, struct argp_state *state)
         udata->daemonize = 1;
         break;
 
+    case 'f':
+        value = atoi(arg);
+        udata->fragment = (value > 1) ? value : 1;
+        break;
+
+    case 'F':
+        if (strcmp(arg, "u8") == 0) {
+            udata->format = G710P_METER_FORMAT_U8;
+        } else if (strcmp(arg, "s16") == 0) {
+            udata->format = G710P_METER_FORMAT_S16;
+        } else if (strcmp(arg, "f32") == 0) {
+            udata->format = G710P_METER_FORMAT_F32;
+        } else {
+            argp_error(state, "Invalid sample format: %s", arg);
+        }
+
+        udata->format_set = 1;
+        break;
+
     case 'p':
         udata->peak_max = atoi(arg);
 
@@ -239,12 +343,32 @@ parse_opt(int key, char *arg, struct argp_state *state)
         }
         break;
 
+    case 'r':
+        value = atoi(arg);
+
+        if (value < 1) {
+            argp_error(state, "Invalid sample rate: %s", arg);
+        }
+
+        udata->rate = value;
+        break;
+
+    case 'R':
+        udata->rms = 1;
+        break;
+
+    case 's':
+        udata->spectrum = 1;
+        break;
+
     case 'v':
         udata->verbose = 1;
         break;
 
     case ARGP_KEY_INIT:
         udata->peak_max = PEAK_MIN + 64;
+        udata->fragment = FRAGMENT_DEFAULT;
+        udata->format = G710P_METER_FORMAT_S16;
         break;
 
     case ARGP_KEY_ARG:
@@ -263,6 +387,28 @@ parse_opt(int key, char *arg, struct argp_state *state)
         if (udata->daemonize && udata->verbose) {
             udata->verbose = 0;
         }
+
+        if (!udata->spectrum) {
+            if (udata->rate == 0) {
+                udata->rate = RATE_DEFAULT;
+            }
+            break;
+        }
+
+        /* The spectrum is always analysed from float samples */
+        if (udata->format_set) {
+            argp_error(state, "The sample format cannot be set with "
+                       "--spectrum");
+        }
+
+        if (udata->rate == 0) {
+            udata->rate = RATE_SPECTRUM;
+        } else if (udata->rate < G710P_SPECTRUM_RATE_MIN) {
+            argp_error(state, "The sample rate must be at least %u with "
+                       "--spectrum", G710P_SPECTRUM_RATE_MIN);
+        }
+
+        udata->format = G710P_METER_FORMAT_F32;
         break;
 
     default:
@@ -275,7 +421,7 @@ parse_opt(int key, char *arg, struct argp_state *state)
 int
 main(int argc, char *argv[])
 {
-    g710p_tools_device_t *tdevs;
+    g710p_tools_device_t *tdevs = NULL;
     int res;
     int ret = EXIT_SUCCESS;
     pa_context *ctx;
@@ -285,7 +431,12 @@ main(int argc, char *argv[])
 
     static const struct argp_option options[] = {
         {"daemonize", 'd', NULL, 0, "Fork the process to the background", 0},
+        {"fragment", 'f', "MSEC", 0, "Fragment length (Default: 50)", 0},
+        {"format", 'F', "FORMAT", 0, "Sample format (u8, s16, f32)", 0},
         {"peak-max", 'p', "MAX", 0, "Maximum PCM value (133 <= x <= 255)", 0},
+        {"rate", 'r', "RATE", 0, "Sample rate (Default: 8000 or 22050)", 0},
+        {"rms", 'R', NULL, 0, "Set the levels by RMS rather than peak", 0},
+        {"spectrum", 's', NULL, 0, "Set the LEDs by frequency bands", 0},
         {"verbose", 'v', NULL, 0, "Verbosely print additional messages", 0},
         {NULL}
     };
@@ -302,19 +453,37 @@ main(int argc, char *argv[])
 
     memset(&udata, 0, sizeof udata);
     argp_parse(&argp, argc, argv, 0, NULL, &udata);
-    tdevs = g710p_tools_devices_open();
 
-    if (tdevs == NULL) {
-        return EXIT_FAILURE;
+    /* Share the keyboards through g710pd when it is running */
+    udata.client = g710p_tools_client_connect(0, NULL);
+
+    if (udata.client == -1) {
+        tdevs = g710p_tools_devices_open();
+
+        if (tdevs == NULL) {
+            return EXIT_FAILURE;
+        }
     }
 
     /* Daemonize before initializing PulseAudio */
-    if (udata.daemonize && !daemonize()) {
+    if (udata.daemonize && !g710p_tools_daemonize()) {
         g710p_tools_errorln("Failed to daemonize");
         return EXIT_FAILURE;
     }
 
+    /* Start the writers after forking, as threads do not survive it */
+    if ((tdevs != NULL) && !keyboard_start_writers(tdevs)) {
+        g710p_tools_errorln("Failed to start the writer threads");
+        g710p_tools_devices_close(tdevs);
+        return EXIT_FAILURE;
+    }
+
     udata.tdevs = tdevs;
+
+    if (udata.spectrum) {
+        udata.spec = g710p_spectrum_new(udata.rate);
+    }
+
     ml = pa_mainloop_new();
     assert(ml != NULL);
 
@@ -350,6 +519,16 @@ cleanup:
 
     pa_context_unref(ctx);
     pa_mainloop_free(ml);
-    g710p_tools_devices_close(tdevs);
+
+    if (udata.spec != NULL) {
+        g710p_spectrum_free(udata.spec);
+    }
+
+    if (udata.client != -1) {
+        g710p_tools_client_close(udata.client);
+    } else {
+        g710p_tools_devices_close(tdevs);
+    }
+
     return ret;
 }
@@ -0,0 +1,284 @@
+/*
+ * Copyright 2016 James Geboski <jgeboski@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "g710p-spectrum.h"
+
+
+#define G710P_SPECTRUM_BITS  8
+#define G710P_SPECTRUM_BINS  (G710P_SPECTRUM_SIZE / 2)
+#define G710P_SPECTRUM_HOP  (G710P_SPECTRUM_SIZE / 2)
+#define G710P_SPECTRUM_BANDS  (2 + G710P_SPECTRUM_HIGHS)
+#define G710P_SPECTRUM_LOW  20.0
+#define G710P_SPECTRUM_BASS  250.0
+#define G710P_SPECTRUM_MIDS  4000.0
+#define G710P_SPECTRUM_FLOOR  -60.0f
+#define G710P_SPECTRUM_DECAY  0.85f
+
+
+/* Everything is sized up front, so processing never allocates. The real
+ * samples are transformed as half as many complex samples, and then the
+ * halves are split into the bins of the real transform.
+ */
+struct g710p_spectrum
+{
+    float history[G710P_SPECTRUM_SIZE];
+    float window[G710P_SPECTRUM_SIZE];
+    float re[G710P_SPECTRUM_BINS];
+    float im[G710P_SPECTRUM_BINS];
+    float power[G710P_SPECTRUM_BINS];
+    float cos[G710P_SPECTRUM_BINS];
+    float sin[G710P_SPECTRUM_BINS];
+    uint8_t rev[G710P_SPECTRUM_BINS];
+    size_t edges[G710P_SPECTRUM_BANDS + 1];
+    float scale;
+    float levels[G710P_SPECTRUM_BANDS];
+};
+
+
+static size_t
+g710p_spectrum_bin(double freq, uint32_t rate)
+{
+    double bin;
+
+    bin = floor(freq * G710P_SPECTRUM_SIZE / rate + 0.5);
+
+    if (bin < 1) {
+        return 1;
+    }
+
+    if (bin > G710P_SPECTRUM_BINS) {
+        return G710P_SPECTRUM_BINS;
+    }
+
+    return bin;
+}
+
+g710p_spectrum_t *
+g710p_spectrum_new(uint32_t rate)
+{
+    double freq;
+    double nyquist;
+    double sum = 0.0;
+    g710p_spectrum_t *spec;
+    size_t i;
+    unsigned int j;
+    unsigned int rev;
+
+    assert(rate >= G710P_SPECTRUM_RATE_MIN);
+    spec = calloc(1, sizeof *spec);
+    assert(spec != NULL);
+
+    for (i = 0; i < G710P_SPECTRUM_SIZE; i++) {
+        spec->window[i] = 0.5 - 0.5 * cos(2.0 * M_PI * i /
+                                          (G710P_SPECTRUM_SIZE - 1));
+        sum += spec->window[i];
+    }
+
+    /* The twiddles of the forward transform, which negate the sine */
+    for (i = 0; i < G710P_SPECTRUM_BINS; i++) {
+        for (rev = 0, j = 0; j < G710P_SPECTRUM_BITS; j++) {
+            rev |= ((i >> j) & 1) << (G710P_SPECTRUM_BITS - 1 - j);
+        }
+
+        spec->rev[i] = rev;
+        spec->cos[i] = cos(2.0 * M_PI * i / G710P_SPECTRUM_SIZE);
+        spec->sin[i] = -sin(2.0 * M_PI * i / G710P_SPECTRUM_SIZE);
+    }
+
+    /* Scales a full scale sine to an amplitude of one */
+    spec->scale = 2.0 / sum;
+
+    /* The highs are split logarithmically up to the Nyquist frequency */
+    nyquist = rate / 2.0;
+    spec->edges[0] = g710p_spectrum_bin(G710P_SPECTRUM_LOW, rate);
+    spec->edges[1] = g710p_spectrum_bin(G710P_SPECTRUM_BASS, rate);
+    spec->edges[2] = g710p_spectrum_bin(G710P_SPECTRUM_MIDS, rate);
+
+    for (i = 1; i <= G710P_SPECTRUM_HIGHS; i++) {
+        freq = G710P_SPECTRUM_MIDS *
+               pow(nyquist / G710P_SPECTRUM_MIDS,
+                   (double) i / G710P_SPECTRUM_HIGHS);
+        spec->edges[i + 2] = g710p_spectrum_bin(freq, rate);
+
+        if (spec->edges[i + 2] < spec->edges[i + 1]) {
+            spec->edges[i + 2] = spec->edges[i + 1];
+        }
+    }
+
+    return spec;
+}
+
+void
+g710p_spectrum_free(g710p_spectrum_t *spec)
+{
+    free(spec);
+}
+
+static void
+g710p_spectrum_fft(g710p_spectrum_t *spec)
+{
+    float *im = spec->im;
+    float *re = spec->re;
+    float ti;
+    float tr;
+    float wi;
+    float wr;
+    size_t half;
+    size_t i;
+    size_t j;
+    size_t k;
+    size_t l;
+    size_t step;
+
+    /* The twiddles of the half size transform are every other twiddle */
+    for (half = 1; half < G710P_SPECTRUM_BINS; half <<= 1) {
+        step = G710P_SPECTRUM_BINS / half;
+
+        for (i = 0; i < G710P_SPECTRUM_BINS; i += half << 1) {
+            for (j = 0; j < half; j++) {
+                wr = spec->cos[j * step];
+                wi = spec->sin[j * step];
+                k = i + j;
+                l = k + half;
+
+                tr = re[l] * wr - im[l] * wi;
+                ti = re[l] * wi + im[l] * wr;
+                re[l] = re[k] - tr;
+                im[l] = im[k] - ti;
+                re[k] += tr;
+                im[k] += ti;
+            }
+        }
+    }
+}
+
+static void
+g710p_spectrum_split(g710p_spectrum_t *spec)
+{
+    float *im = spec->im;
+    float *re = spec->re;
+    float ei;
+    float er;
+    float oi;
+    float or;
+    float xi;
+    float xr;
+    size_t i;
+    size_t j;
+
+    /* Splits the even and odd samples, skipping the DC bin */
+    for (i = 1; i < G710P_SPECTRUM_BINS; i++) {
+        j = G710P_SPECTRUM_BINS - i;
+        er = 0.5f * (re[i] + re[j]);
+        ei = 0.5f * (im[i] - im[j]);
+        or = 0.5f * (im[i] + im[j]);
+        oi = -0.5f * (re[i] - re[j]);
+
+        xr = er + spec->cos[i] * or - spec->sin[i] * oi;
+        xi = ei + spec->cos[i] * oi + spec->sin[i] * or;
+        spec->power[i] = xr * xr + xi * xi;
+    }
+}
+
+static void
+g710p_spectrum_analyze(g710p_spectrum_t *spec, float *peaks)
+{
+    float db;
+    float level;
+    float power;
+    size_t i;
+    size_t j;
+
+    for (i = 0; i < G710P_SPECTRUM_BINS; i++) {
+        j = i << 1;
+        spec->re[spec->rev[i]] = spec->history[j] * spec->window[j];
+        spec->im[spec->rev[i]] = spec->history[j + 1] * spec->window[j + 1];
+    }
+
+    g710p_spectrum_fft(spec);
+    g710p_spectrum_split(spec);
+
+    for (i = 0; i < G710P_SPECTRUM_BANDS; i++) {
+        power = 0.0f;
+
+        for (j = spec->edges[i]; j < spec->edges[i + 1]; j++) {
+            power += spec->power[j];
+        }
+
+        level = 0.0f;
+
+        if (j > spec->edges[i]) {
+            power *= spec->scale * spec->scale;
+            db = 10.0f * log10f(power / (j - spec->edges[i]) + 1e-12f);
+            level = 1.0f - db / G710P_SPECTRUM_FLOOR;
+            level = fminf(fmaxf(level, 0.0f), 1.0f);
+        }
+
+        peaks[i] = fmaxf(peaks[i], level);
+    }
+}
+
+void
+g710p_spectrum_process(
+    g710p_spectrum_t *spec,
+    const float *samples,
+    size_t count,
+    g710p_spectrum_levels_t *levels)
+{
+    float peaks[G710P_SPECTRUM_BANDS];
+    size_t i;
+    size_t keep;
+    size_t n;
+
+    assert(spec != NULL);
+    assert(samples != NULL);
+    assert(levels != NULL);
+    memset(peaks, 0, sizeof peaks);
+
+    /* Every sample is analysed, with the windows overlapping by half,
+     * and the loudest level of each band across the windows is kept.
+     */
+    do {
+        n = (count < G710P_SPECTRUM_HOP) ? count : G710P_SPECTRUM_HOP;
+        keep = G710P_SPECTRUM_SIZE - n;
+        memmove(spec->history, spec->history + n,
+                keep * sizeof *spec->history);
+        memcpy(spec->history + keep, samples, n * sizeof *samples);
+        samples += n;
+        count -= n;
+        g710p_spectrum_analyze(spec, peaks);
+    } while (count > 0);
+
+    /* Decays the levels, rather than letting them flicker */
+    for (i = 0; i < G710P_SPECTRUM_BANDS; i++) {
+        spec->levels[i] = fmaxf(peaks[i],
+                                spec->levels[i] * G710P_SPECTRUM_DECAY);
+    }
+
+    levels->bass = spec->levels[0];
+    levels->mids = spec->levels[1];
+
+    for (i = 0; i < G710P_SPECTRUM_HIGHS; i++) {
+        levels->highs[i] = spec->levels[i + 2];
+    }
+}
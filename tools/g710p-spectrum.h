@@ -0,0 +1,56 @@
+/*
+ * Copyright 2016 James Geboski <jgeboski@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _G710P_SPECTRUM_H_
+#define _G710P_SPECTRUM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define G710P_SPECTRUM_SIZE  512
+#define G710P_SPECTRUM_HIGHS  4
+#define G710P_SPECTRUM_RATE_MIN  11025
+
+
+typedef struct g710p_spectrum g710p_spectrum_t;
+typedef struct g710p_spectrum_levels g710p_spectrum_levels_t;
+
+
+struct g710p_spectrum_levels
+{
+    float bass;
+    float mids;
+    float highs[G710P_SPECTRUM_HIGHS];
+};
+
+
+g710p_spectrum_t *
+g710p_spectrum_new(uint32_t rate);
+
+void
+g710p_spectrum_free(g710p_spectrum_t *spec);
+
+void
+g710p_spectrum_process(
+    g710p_spectrum_t *spec,
+    const float *samples,
+    size_t count,
+    g710p_spectrum_levels_t *levels);
+
+#endif /* _G710P_SPECTRUM_H_ */
@@ -16,9 +16,17 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/uinput.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include "g710p-tools-common.h"
 
@@ -46,12 +54,275 @@ g710p_tools_println(const char *format, ...)
     printf("\n");
 }
 
+int
+g710p_tools_daemonize(void)
+{
+    int fd;
+
+    switch (fork()) {
+    case 0:
+        break;
+
+    case -1:
+        return 0;
+
+    default:
+        exit(EXIT_SUCCESS);
+    }
+
+    fd = open("/dev/null", O_RDWR);
+
+    if (fd == -1) {
+        return 0;
+    }
+
+    return (setsid() != -1) &&
+           (chdir("/") != -1) &&
+           (dup2(fd, STDIN_FILENO) != -1) &&
+           (dup2(fd, STDOUT_FILENO) != -1) &&
+           (dup2(fd, STDERR_FILENO) != -1);
+}
+
+void
+g710p_tools_socket_path(char *path, size_t size)
+{
+    const char *dir;
+
+    dir = getenv("XDG_RUNTIME_DIR");
+
+    if ((dir == NULL) || (*dir == 0)) {
+        dir = "/tmp";
+    }
+
+    snprintf(path, size, "%s/%s", dir, G710PD_SOCKET);
+}
+
+int
+g710p_tools_uinput_open(const char *name, const uint16_t *codes, size_t count)
+{
+    int fd;
+    size_t i;
+    struct uinput_setup setup;
+
+    fd = open("/dev/uinput", O_WRONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        g710p_tools_errorln("Failed to open /dev/uinput: %s", strerror(errno));
+        return -1;
+    }
+
+    if (ioctl(fd, UI_SET_EVBIT, EV_KEY) != 0) {
+        goto error;
+    }
+
+    for (i = 0; i < count; i++) {
+        if ((codes[i] != 0) && (ioctl(fd, UI_SET_KEYBIT, codes[i]) != 0)) {
+            goto error;
+        }
+    }
+
+    memset(&setup, 0, sizeof setup);
+    setup.id.bustype = BUS_VIRTUAL;
+    setup.id.vendor = G710P_VENDOR_ID;
+    setup.id.product = G710P_PRODUCT_ID;
+    strncpy(setup.name, name, UINPUT_MAX_NAME_SIZE - 1);
+
+    if ((ioctl(fd, UI_DEV_SETUP, &setup) != 0) ||
+        (ioctl(fd, UI_DEV_CREATE) != 0))
+    {
+        goto error;
+    }
+
+    return fd;
+
+error:
+    g710p_tools_errorln("Failed to create uinput device: %s", strerror(errno));
+    close(fd);
+    return -1;
+}
+
+void
+g710p_tools_uinput_close(int fd)
+{
+    ioctl(fd, UI_DEV_DESTROY);
+    close(fd);
+}
+
+/* Connects to a running g710pd, returning -1 quietly if there is none,
+ * so that the tools can fall back to opening the devices themselves.
+ */
+int
+g710p_tools_client_connect(uint8_t subs, g710pd_msg_t *info)
+{
+    g710pd_msg_t msg;
+    int fd;
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    g710p_tools_socket_path(addr.sun_path, sizeof addr.sun_path);
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof addr) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    if (!g710p_tools_client_recv(fd, &msg) ||
+        (msg.type != G710PD_MSG_INFO) ||
+        (msg.data[0] != G710PD_VERSION))
+    {
+        g710p_tools_errorln("Unsupported g710pd at %s", addr.sun_path);
+        close(fd);
+        return -1;
+    }
+
+    if (info != NULL) {
+        *info = msg;
+    }
+
+    memset(&msg, 0, sizeof msg);
+    msg.type = G710PD_MSG_SUBSCRIBE;
+    msg.data[0] = subs;
+
+    if ((subs != 0) && (send(fd, &msg, sizeof msg, MSG_NOSIGNAL) < 0)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+void
+g710p_tools_client_close(int fd)
+{
+    close(fd);
+}
+
+int
+g710p_tools_client_recv(int fd, g710pd_msg_t *msg)
+{
+    ssize_t res;
+
+    do {
+        res = recv(fd, msg, sizeof *msg, 0);
+    } while ((res < 0) && (errno == EINTR));
+
+    return res == sizeof *msg;
+}
+
+void
+g710p_tools_client_report(const g710pd_msg_t *msg, g710p_report_t *report)
+{
+    assert(msg->type == G710PD_MSG_REPORT);
+    memset(report, 0, sizeof *report);
+    report->type = msg->data[0];
+    report->media_keys = msg->data[1];
+    report->g_keys = msg->data[2] | (msg->data[3] << 8);
+    report->kb_level = msg->data[4];
+    report->wasd_level = msg->data[5];
+}
+
+void
+g710p_tools_client_key(const g710pd_msg_t *msg, g710p_key_event_t *event)
+{
+    assert(msg->type == G710PD_MSG_KEY);
+    memset(event, 0, sizeof *event);
+    event->time = g710p_time_ns();
+    event->type = msg->data[0];
+    event->pressed = msg->data[1];
+    event->key = msg->data[2] | (msg->data[3] << 8);
+}
+
+static int
+g710p_tools_client_send(int fd, uint8_t type, uint8_t device, uint8_t a,
+                        uint8_t b)
+{
+    g710pd_msg_t msg;
+
+    memset(&msg, 0, sizeof msg);
+    msg.type = type;
+    msg.device = device;
+    msg.data[0] = a;
+    msg.data[1] = b;
+
+    /* The latest state wins, so a state which does not fit is dropped */
+    return send(fd, &msg, sizeof msg, MSG_DONTWAIT | MSG_NOSIGNAL) ==
+           sizeof msg;
+}
+
+int
+g710p_tools_client_set_levels(int fd, uint8_t device, uint8_t kb,
+                              uint8_t wasd)
+{
+    return g710p_tools_client_send(fd, G710PD_MSG_LEVELS, device, kb, wasd);
+}
+
+int
+g710p_tools_client_set_leds(int fd, uint8_t device, uint8_t keys)
+{
+    return g710p_tools_client_send(fd, G710PD_MSG_LEDS, device, keys, 0);
+}
+
+g710p_tools_device_t *
+g710p_tools_device_open(const char *path)
+{
+    g710p_device_t *dev;
+    g710p_tools_device_t *tdev;
+
+    dev = g710p_open(path);
+
+    if (dev == NULL) {
+        g710p_tools_errorln("Failed to open %s", path);
+        return NULL;
+    }
+
+    tdev = calloc(1, sizeof *tdev);
+    assert(tdev != NULL);
+    tdev->dev = dev;
+    tdev->path = strdup(path);
+    assert(tdev->path != NULL);
+
+    if (!g710p_backlight_get_levels(dev, &tdev->kb_level, &tdev->wasd_level)) {
+        g710p_tools_errorln("Failed to get bl levels for %s", path);
+    }
+
+    if (!g710p_mkeys_get_leds(dev, &tdev->m_keys)) {
+        g710p_tools_errorln("Failed to get LED states for %s", path);
+    }
+
+    return tdev;
+}
+
+void
+g710p_tools_device_close(g710p_tools_device_t *tdev, int restore)
+{
+    /* Flush any writer before restoring the original states */
+    g710p_writer_stop(tdev->dev);
+
+    if (restore && !g710p_backlight_set_levels(tdev->dev, tdev->kb_level,
+                                               tdev->wasd_level))
+    {
+        g710p_tools_errorln("Failed to set bl levels for %s", tdev->path);
+    }
+
+    if (restore && !g710p_mkeys_set_leds(tdev->dev, tdev->m_keys)) {
+        g710p_tools_errorln("Failed to set LED states for %s", tdev->path);
+    }
+
+    g710p_close(tdev->dev);
+    free(tdev->path);
+    free(tdev);
+}
+
 g710p_tools_device_t *
 g710p_tools_devices_open(void)
 {
     char **devlist;
-    const char *path;
-    g710p_device_t *dev;
     g710p_tools_device_t *tail = NULL;
     g710p_tools_device_t *tdev;
     g710p_tools_device_t *tdevs = NULL;
@@ -66,18 +337,13 @@ g710p_tools_devices_open(void)
     devlist = g710p_device_list_get();
 
     for (i = 0; devlist[i] != NULL; i++) {
-        path = devlist[i];
-        g710p_tools_println("Opening %s as device %u", path, n);
-        dev = g710p_open(path);
+        g710p_tools_println("Opening %s as device %u", devlist[i], n);
+        tdev = g710p_tools_device_open(devlist[i]);
 
-        if (dev == NULL) {
-            g710p_tools_errorln("Failed to open %s, skipping", path);
+        if (tdev == NULL) {
             continue;
         }
 
-        tdev = calloc(1, sizeof *tdev);
-        assert(tdev != NULL);
-        tdev->dev = dev;
         n++;
 
         if (tail != NULL) {
@@ -87,14 +353,6 @@ g710p_tools_devices_open(void)
             tdevs = tdev;
             tail = tdev;
         }
-
-        if (!g710p_backlight_get_levels(dev, &tdev->kb_level, &tdev->wasd_level)) {
-            g710p_tools_errorln("Failed to get bl levels for device %u", n);
-        }
-
-        if (!g710p_mkeys_get_leds(dev, &tdev->m_keys)) {
-            g710p_tools_errorln("Failed to get LED states for device %u", n);
-        }
     }
 
     if (tdevs == NULL) {
@@ -109,22 +367,11 @@ void
 g710p_tools_devices_close(g710p_tools_device_t *tdevs)
 {
     g710p_tools_device_t *tdev;
-    unsigned int n;
 
-    for (n = 1; tdevs != NULL; n++) {
+    while (tdevs != NULL) {
         tdev = tdevs;
         tdevs = tdevs->next;
-
-        if (!g710p_backlight_set_levels(tdev->dev, tdev->kb_level, tdev->wasd_level)) {
-            g710p_tools_errorln("Failed to set bl levels for device %u", n);
-        }
-
-        if (!g710p_mkeys_set_leds(tdev->dev, tdev->m_keys)) {
-            g710p_tools_errorln("Failed to set LED states for device %u", n);
-        }
-
-        g710p_close(tdev->dev);
-        free(tdev);
+        g710p_tools_device_close(tdev, 1);
     }
 
     if (!g710p_exit()) {
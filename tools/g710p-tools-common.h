@@ -20,6 +20,8 @@
 
 #include <g710p.h>
 
+#include "g710pd-protocol.h"
+
 
 typedef struct g710p_tools_device g710p_tools_device_t;
 
@@ -28,6 +30,7 @@ struct g710p_tools_device
 {
     g710p_tools_device_t *next;
     g710p_device_t *dev;
+    char *path;
     uint8_t kb_level;
     uint8_t wasd_level;
     uint8_t m_keys;
@@ -40,6 +43,46 @@ g710p_tools_errorln(const char *format, ...);
 void
 g710p_tools_println(const char *format, ...);
 
+int
+g710p_tools_daemonize(void);
+
+void
+g710p_tools_socket_path(char *path, size_t size);
+
+int
+g710p_tools_uinput_open(const char *name, const uint16_t *codes, size_t count);
+
+void
+g710p_tools_uinput_close(int fd);
+
+int
+g710p_tools_client_connect(uint8_t subs, g710pd_msg_t *info);
+
+void
+g710p_tools_client_close(int fd);
+
+int
+g710p_tools_client_recv(int fd, g710pd_msg_t *msg);
+
+void
+g710p_tools_client_report(const g710pd_msg_t *msg, g710p_report_t *report);
+
+void
+g710p_tools_client_key(const g710pd_msg_t *msg, g710p_key_event_t *event);
+
+int
+g710p_tools_client_set_levels(int fd, uint8_t device, uint8_t kb,
+                              uint8_t wasd);
+
+int
+g710p_tools_client_set_leds(int fd, uint8_t device, uint8_t keys);
+
+g710p_tools_device_t *
+g710p_tools_device_open(const char *path);
+
+void
+g710p_tools_device_close(g710p_tools_device_t *tdev, int restore);
+
 g710p_tools_device_t *
 g710p_tools_devices_open(void);
 
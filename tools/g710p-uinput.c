@@ -0,0 +1,328 @@
+/*
+ * Copyright 2016 James Geboski <jgeboski@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <argp.h>
+#include <assert.h>
+#include <errno.h>
+#include <linux/input.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "g710p-tools-common.h"
+
+
+#define CODES_MEDIA  8
+#define CODES_G  16
+#define REPORTS_MAX  16
+
+
+typedef struct keymap keymap_t;
+typedef struct user_data user_data_t;
+
+
+struct keymap
+{
+    const char *name;
+    uint8_t type;
+    uint16_t key;
+    uint16_t code;
+};
+
+struct user_data
+{
+    int fd;
+    int verbose;
+    uint16_t media_codes[CODES_MEDIA];
+    uint16_t g_codes[CODES_G];
+};
+
+
+const char *argp_program_version = PACKAGE_STRING;
+const char *argp_program_bug_address = PACKAGE_BUGREPORT;
+
+static int quit = 0;
+
+static const keymap_t keymaps[] = {
+    {"next", G710P_REPORT_MEDIA_KEYS, G710P_KEY_NEXT, KEY_NEXTSONG},
+    {"prev", G710P_REPORT_MEDIA_KEYS, G710P_KEY_PREV, KEY_PREVIOUSSONG},
+    {"stop", G710P_REPORT_MEDIA_KEYS, G710P_KEY_STOP, KEY_STOPCD},
+    {"play", G710P_REPORT_MEDIA_KEYS, G710P_KEY_PLAY, KEY_PLAYPAUSE},
+    {"vlup", G710P_REPORT_MEDIA_KEYS, G710P_KEY_VLUP, KEY_VOLUMEUP},
+    {"vldn", G710P_REPORT_MEDIA_KEYS, G710P_KEY_VLDN, KEY_VOLUMEDOWN},
+    {"mute", G710P_REPORT_MEDIA_KEYS, G710P_KEY_MUTE, KEY_MUTE},
+    {"m1", G710P_REPORT_G_KEYS, G710P_KEY_M1, KEY_PROG1},
+    {"m2", G710P_REPORT_G_KEYS, G710P_KEY_M2, KEY_PROG2},
+    {"m3", G710P_REPORT_G_KEYS, G710P_KEY_M3, KEY_PROG3},
+    {"mr", G710P_REPORT_G_KEYS, G710P_KEY_MR, KEY_PROG4},
+    {"g1", G710P_REPORT_G_KEYS, G710P_KEY_G1, KEY_F13},
+    {"g2", G710P_REPORT_G_KEYS, G710P_KEY_G2, KEY_F14},
+    {"g3", G710P_REPORT_G_KEYS, G710P_KEY_G3, KEY_F15},
+    {"g4", G710P_REPORT_G_KEYS, G710P_KEY_G4, KEY_F16},
+    {"g5", G710P_REPORT_G_KEYS, G710P_KEY_G5, KEY_F17},
+    {"g6", G710P_REPORT_G_KEYS, G710P_KEY_G6, KEY_F18}
+};
+
+
+static void
+sighandler(int signal)
+{
+    quit = 1;
+}
+
+static uint16_t *
+keymap_code(user_data_t *udata, uint8_t type, uint16_t key)
+{
+    unsigned int bit;
+
+    bit = __builtin_ctz(key);
+
+    switch (type) {
+    case G710P_REPORT_MEDIA_KEYS:
+        return (bit < CODES_MEDIA) ? &udata->media_codes[bit] : NULL;
+
+    case G710P_REPORT_G_KEYS:
+        return (bit < CODES_G) ? &udata->g_codes[bit] : NULL;
+    }
+
+    return NULL;
+}
+
+static int
+keymap_set(user_data_t *udata, const char *arg)
+{
+    char *end;
+    const char *sep;
+    long code;
+    size_t i;
+    size_t size;
+
+    sep = strchr(arg, '=');
+
+    if (sep == NULL) {
+        return 0;
+    }
+
+    size = sep - arg;
+    code = strtol(sep + 1, &end, 0);
+
+    if ((*end != 0) || (code < 0) || (code > KEY_MAX)) {
+        return 0;
+    }
+
+    for (i = 0; i < (sizeof keymaps / sizeof *keymaps); i++) {
+        if ((strlen(keymaps[i].name) == size) &&
+            (strncmp(keymaps[i].name, arg, size) == 0))
+        {
+            *keymap_code(udata, keymaps[i].type, keymaps[i].key) = code;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void
+report_handle(user_data_t *udata, g710p_device_t *dev,
+              const g710p_report_t *report, uint64_t time)
+{
+    g710p_key_event_t events[G710P_KEY_EVENTS_MAX];
+    size_t count;
+    size_t i;
+    size_t size;
+    struct input_event evs[G710P_KEY_EVENTS_MAX + 1];
+    uint16_t *code;
+    unsigned int n = 0;
+
+    count = g710p_report_events(dev, report, time, events);
+
+    for (i = 0; i < count; i++) {
+        code = keymap_code(udata, events[i].type, events[i].key);
+
+        if ((code == NULL) || (*code == 0)) {
+            continue;
+        }
+
+        memset(&evs[n], 0, sizeof evs[n]);
+        evs[n].type = EV_KEY;
+        evs[n].code = *code;
+        evs[n].value = events[i].pressed;
+        n++;
+    }
+
+    if (n == 0) {
+        return;
+    }
+
+    /* Every transition of the report is a single write and frame */
+    memset(&evs[n], 0, sizeof evs[n]);
+    evs[n].type = EV_SYN;
+    evs[n].code = SYN_REPORT;
+    size = (sizeof *evs) * (n + 1);
+
+    if (write(udata->fd, evs, size) != (ssize_t) size) {
+        g710p_tools_errorln("Failed to write events: %s", strerror(errno));
+        return;
+    }
+
+    if (udata->verbose) {
+        g710p_tools_println(
+            "Injected %u events in %llu ns",
+            n,
+            (unsigned long long) (g710p_time_ns() - time)
+        );
+    }
+}
+
+static error_t
+parse_opt(int key, char *arg, struct argp_state *state)
+{
+    user_data_t *udata = state->input;
+
+    switch (key) {
+    case 'm':
+        if (!keymap_set(udata, arg)) {
+            argp_error(state, "Invalid key mapping: %s", arg);
+        }
+        break;
+
+    case 'v':
+        udata->verbose = 1;
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    g710p_device_t **devs;
+    g710p_report_t reports[REPORTS_MAX];
+    g710p_tools_device_t *tdev;
+    g710p_tools_device_t *tdevs;
+    int i;
+    int *ready;
+    int res;
+    size_t j;
+    uint16_t codes[CODES_MEDIA + CODES_G];
+    uint64_t time;
+    unsigned int count;
+    unsigned int m;
+    unsigned int n;
+    user_data_t udata;
+
+    static const struct argp_option options[] = {
+        {"map", 'm', "KEY=CODE", 0, "Map a key (next, prev, stop, play, "
+         "vlup, vldn, mute, m1-m3, mr, g1-g6) to a keycode, or 0 for none", 0},
+        {"verbose", 'v', NULL, 0, "Verbosely print additional messages", 0},
+        {NULL}
+    };
+
+    static const struct argp argp = {
+        options,
+        parse_opt,
+        NULL,
+        "Injects the G710+ G, M and media keys as uinput key events",
+        NULL,
+        NULL,
+        NULL
+    };
+
+    memset(&udata, 0, sizeof udata);
+
+    for (j = 0; j < (sizeof keymaps / sizeof *keymaps); j++) {
+        *keymap_code(&udata, keymaps[j].type, keymaps[j].key) =
+            keymaps[j].code;
+    }
+
+    argp_parse(&argp, argc, argv, 0, NULL, &udata);
+    memcpy(codes, udata.media_codes, sizeof udata.media_codes);
+    memcpy(codes + CODES_MEDIA, udata.g_codes, sizeof udata.g_codes);
+    udata.fd = g710p_tools_uinput_open("Logitech G710+ Keys", codes,
+                                       CODES_MEDIA + CODES_G);
+
+    if (udata.fd == -1) {
+        return EXIT_FAILURE;
+    }
+
+    tdevs = g710p_tools_devices_open();
+
+    if (tdevs == NULL) {
+        g710p_tools_uinput_close(udata.fd);
+        return EXIT_FAILURE;
+    }
+
+    for (count = 0, tdev = tdevs; tdev != NULL; tdev = tdev->next) {
+        count++;
+    }
+
+    devs = malloc((sizeof *devs) * count);
+    ready = malloc((sizeof *ready) * count);
+    assert((devs != NULL) && (ready != NULL));
+
+    for (n = 0, tdev = tdevs; tdev != NULL; n++, tdev = tdev->next) {
+        devs[n] = tdev->dev;
+    }
+
+    signal(SIGINT, sighandler);
+    signal(SIGTERM, sighandler);
+
+    while (!quit) {
+        if (g710p_wait_any(devs, count, ready, -1) < 0) {
+            g710p_tools_errorln("Failed to wait for devices");
+            break;
+        }
+
+        /* A lost device stays readable, so it is dropped from the wait */
+        for (n = 0, m = 0; n < count; n++) {
+            if (ready[n]) {
+                res = g710p_report_get_many(devs[n], reports, REPORTS_MAX, 0);
+                time = g710p_time_ns();
+
+                if (res < 0) {
+                    g710p_tools_errorln("Lost a device");
+                    continue;
+                }
+
+                for (i = 0; i < res; i++) {
+                    report_handle(&udata, devs[n], &reports[i], time);
+                }
+            }
+
+            devs[m++] = devs[n];
+        }
+
+        count = m;
+
+        if (count == 0) {
+            g710p_tools_errorln("Lost every device");
+            break;
+        }
+    }
+
+    free(devs);
+    free(ready);
+    g710p_tools_devices_close(tdevs);
+    g710p_tools_uinput_close(udata.fd);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,546 @@
+/*
+ * Copyright 2016 James Geboski <jgeboski@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <argp.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/uhid.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "g710p-tools-common.h"
+
+
+#define REPORTS_MEDIA  (1 << 0)
+#define REPORTS_G  (1 << 1)
+#define REPORTS_CNTRL  (1 << 2)
+#define REPORTS_ALL  (REPORTS_MEDIA | REPORTS_G | REPORTS_CNTRL)
+
+#define INJECT_MAX  4096
+
+
+typedef struct user_data user_data_t;
+
+
+struct user_data
+{
+    int fd;
+    int verbose;
+    unsigned int rate;
+    unsigned long count;
+    unsigned long sent;
+    unsigned int reports;
+    unsigned int step;
+    uint8_t kb_level;
+    uint8_t wasd_level;
+    uint8_t m_leds;
+};
+
+
+const char *argp_program_version = PACKAGE_STRING;
+const char *argp_program_bug_address = PACKAGE_BUGREPORT;
+
+static int quit = 0;
+
+/* Vendor defined collection with the reports of the auxiliary interface:
+ * input reports 0x02 (1 byte), 0x03 (3 bytes) and 0x04 (7 bytes), and
+ * feature reports 0x06 (1 byte) and 0x08 (3 bytes).
+ */
+static const uint8_t rdesc[] = {
+    0x06, 0x00, 0xFF,  /* Usage Page (Vendor Defined 0xFF00) */
+    0x09, 0x01,  /* Usage (0x01) */
+    0xA1, 0x01,  /* Collection (Application) */
+    0x15, 0x00,  /*   Logical Minimum (0) */
+    0x26, 0xFF, 0x00,  /*   Logical Maximum (255) */
+    0x75, 0x08,  /*   Report Size (8) */
+    0x85, G710P_REPORT_MEDIA_KEYS,  /*   Report ID */
+    0x95, 0x01,  /*   Report Count (1) */
+    0x09, 0x02,  /*   Usage (0x02) */
+    0x81, 0x02,  /*   Input (Data, Variable, Absolute) */
+    0x85, G710P_REPORT_G_KEYS,  /*   Report ID */
+    0x95, 0x03,  /*   Report Count (3) */
+    0x09, 0x03,  /*   Usage (0x03) */
+    0x81, 0x02,  /*   Input (Data, Variable, Absolute) */
+    0x85, G710P_REPORT_CNTRL_KEYS,  /*   Report ID */
+    0x95, 0x07,  /*   Report Count (7) */
+    0x09, 0x04,  /*   Usage (0x04) */
+    0x81, 0x02,  /*   Input (Data, Variable, Absolute) */
+    0x85, G710P_REPORT_M_LEDS,  /*   Report ID */
+    0x95, 0x01,  /*   Report Count (1) */
+    0x09, 0x06,  /*   Usage (0x06) */
+    0xB1, 0x02,  /*   Feature (Data, Variable, Absolute) */
+    0x85, G710P_REPORT_BL_LVLS,  /*   Report ID */
+    0x95, 0x03,  /*   Report Count (3) */
+    0x09, 0x08,  /*   Usage (0x08) */
+    0xB1, 0x02,  /*   Feature (Data, Variable, Absolute) */
+    0xC0  /* End Collection */
+};
+
+
+static void
+sighandler(int signal)
+{
+    quit = 1;
+}
+
+static int
+uhid_write(int fd, const struct uhid_event *ev)
+{
+    ssize_t res;
+
+    res = write(fd, ev, sizeof *ev);
+
+    if (res != sizeof *ev) {
+        g710p_tools_errorln("Failed to write to uhid: %s", strerror(errno));
+        return 0;
+    }
+
+    return 1;
+}
+
+static int
+uhid_create(int fd)
+{
+    struct uhid_event ev;
+
+    memset(&ev, 0, sizeof ev);
+    ev.type = UHID_CREATE2;
+    strcpy((char *) ev.u.create2.name, "Logitech G710+ (virtual)");
+    strcpy((char *) ev.u.create2.phys, "g710p-virtual/input1");
+    memcpy(ev.u.create2.rd_data, rdesc, sizeof rdesc);
+    ev.u.create2.rd_size = sizeof rdesc;
+    ev.u.create2.bus = BUS_USB;
+    ev.u.create2.vendor = G710P_VENDOR_ID;
+    ev.u.create2.product = G710P_PRODUCT_ID;
+    return uhid_write(fd, &ev);
+}
+
+static void
+uhid_destroy(int fd)
+{
+    struct uhid_event ev;
+
+    memset(&ev, 0, sizeof ev);
+    ev.type = UHID_DESTROY;
+    uhid_write(fd, &ev);
+}
+
+static int
+uhid_input(int fd, const uint8_t *data, uint16_t size)
+{
+    struct uhid_event ev;
+
+    memset(&ev, 0, sizeof ev);
+    ev.type = UHID_INPUT2;
+    ev.u.input2.size = size;
+    memcpy(ev.u.input2.data, data, size);
+    return uhid_write(fd, &ev);
+}
+
+static int
+handle_get_report(user_data_t *udata, const struct uhid_event *req)
+{
+    struct uhid_event ev;
+    uint8_t *data;
+
+    memset(&ev, 0, sizeof ev);
+    ev.type = UHID_GET_REPORT_REPLY;
+    ev.u.get_report_reply.id = req->u.get_report.id;
+    data = ev.u.get_report_reply.data;
+
+    switch (req->u.get_report.rnum) {
+    case G710P_REPORT_M_LEDS:
+        data[0] = G710P_REPORT_M_LEDS;
+        data[1] = udata->m_leds;
+        ev.u.get_report_reply.size = 2;
+        break;
+
+    case G710P_REPORT_BL_LVLS:
+        data[0] = G710P_REPORT_BL_LVLS;
+        data[1] = udata->wasd_level;
+        data[2] = udata->kb_level;
+        data[3] = 0x00;
+        ev.u.get_report_reply.size = 4;
+        break;
+
+    default:
+        ev.u.get_report_reply.err = EIO;
+        break;
+    }
+
+    return uhid_write(udata->fd, &ev);
+}
+
+static int
+handle_set_report(user_data_t *udata, const struct uhid_event *req)
+{
+    const uint8_t *data = req->u.set_report.data;
+    struct uhid_event ev;
+    uint16_t size = req->u.set_report.size;
+
+    memset(&ev, 0, sizeof ev);
+    ev.type = UHID_SET_REPORT_REPLY;
+    ev.u.set_report_reply.id = req->u.set_report.id;
+
+    switch (req->u.set_report.rnum) {
+    case G710P_REPORT_M_LEDS:
+        if (size >= 2) {
+            udata->m_leds = data[1] & G710P_KEY_MASK_M;
+        } else {
+            ev.u.set_report_reply.err = EINVAL;
+        }
+        break;
+
+    case G710P_REPORT_BL_LVLS:
+        if ((size >= 3) && (data[1] <= 4) && (data[2] <= 4)) {
+            udata->wasd_level = data[1];
+            udata->kb_level = data[2];
+        } else {
+            ev.u.set_report_reply.err = EINVAL;
+        }
+        break;
+
+    default:
+        ev.u.set_report_reply.err = EIO;
+        break;
+    }
+
+    if (udata->verbose && (ev.u.set_report_reply.err == 0)) {
+        g710p_tools_println(
+            "Set report 0x%0x: M LEDs: 0x%0x, Keyboard Level: %u, "
+            "WASD Level: %u",
+            req->u.set_report.rnum,
+            udata->m_leds,
+            udata->kb_level,
+            udata->wasd_level
+        );
+    }
+
+    return uhid_write(udata->fd, &ev);
+}
+
+static int
+uhid_dispatch(user_data_t *udata)
+{
+    ssize_t res;
+    struct uhid_event ev;
+
+    res = read(udata->fd, &ev, sizeof ev);
+
+    if (res < 0) {
+        if ((errno == EAGAIN) || (errno == EINTR)) {
+            return 1;
+        }
+
+        g710p_tools_errorln("Failed to read from uhid: %s", strerror(errno));
+        return 0;
+    }
+
+    switch (ev.type) {
+    case UHID_GET_REPORT:
+        return handle_get_report(udata, &ev);
+
+    case UHID_SET_REPORT:
+        return handle_set_report(udata, &ev);
+    }
+
+    return 1;
+}
+
+/* Cycles through a press and a release of every enabled key type, and
+ * a control keys report with the current backlight levels. Returns the
+ * size of the report written to data, or 0 if the step is disabled.
+ */
+static uint16_t
+report_next(user_data_t *udata, uint8_t *data)
+{
+    unsigned int cycle;
+    unsigned int step = udata->step++ % 5;
+
+    /* Seven media keys, and six G keys */
+    cycle = udata->step / 5;
+    memset(data, 0, 8);
+
+    switch (step) {
+    case 0:
+    case 1:
+        if (!(udata->reports & REPORTS_MEDIA)) {
+            return 0;
+        }
+
+        data[0] = G710P_REPORT_MEDIA_KEYS;
+        data[1] = (step == 0) ? (1 << (cycle % 7)) : 0x00;
+        return 2;
+
+    case 2:
+    case 3:
+        if (!(udata->reports & REPORTS_G)) {
+            return 0;
+        }
+
+        data[0] = G710P_REPORT_G_KEYS;
+        data[1] = (step == 2) ? (1 << (cycle % 6)) : 0x00;
+        data[2] = (step == 2) ? (G710P_KEY_M1 << (cycle % 4)) : 0x00;
+        return 4;
+
+    default:
+        if (!(udata->reports & REPORTS_CNTRL)) {
+            return 0;
+        }
+
+        data[0] = G710P_REPORT_CNTRL_KEYS;
+        data[2] = udata->wasd_level;
+        data[3] = udata->kb_level;
+        return 8;
+    }
+}
+
+static int
+inject_reports(user_data_t *udata, uint64_t count)
+{
+    uint16_t size;
+    uint8_t data[8];
+
+    if (count > INJECT_MAX) {
+        count = INJECT_MAX;
+    }
+
+    while (count > 0) {
+        if ((udata->count != 0) && (udata->sent >= udata->count)) {
+            quit = 1;
+            break;
+        }
+
+        size = report_next(udata, data);
+
+        if (size == 0) {
+            continue;
+        }
+
+        if (!uhid_input(udata->fd, data, size)) {
+            return 0;
+        }
+
+        udata->sent++;
+        count--;
+    }
+
+    return 1;
+}
+
+static int
+timer_create_rate(unsigned int rate)
+{
+    int fd;
+    struct itimerspec its;
+    uint64_t ns = 1000000000ULL / rate;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    its.it_interval.tv_sec = ns / 1000000000ULL;
+    its.it_interval.tv_nsec = ns % 1000000000ULL;
+    its.it_value = its.it_interval;
+
+    if (timerfd_settime(fd, 0, &its, NULL) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static unsigned int
+parse_reports(const char *arg)
+{
+    char *str;
+    char *tok;
+    char *save = NULL;
+    unsigned int reports = 0;
+
+    str = strdup(arg);
+    assert(str != NULL);
+
+    for (tok = strtok_r(str, ",", &save); tok != NULL;
+         tok = strtok_r(NULL, ",", &save))
+    {
+        if (strcmp(tok, "media") == 0) {
+            reports |= REPORTS_MEDIA;
+        } else if (strcmp(tok, "g") == 0) {
+            reports |= REPORTS_G;
+        } else if (strcmp(tok, "control") == 0) {
+            reports |= REPORTS_CNTRL;
+        } else if (strcmp(tok, "all") == 0) {
+            reports |= REPORTS_ALL;
+        }
+    }
+
+    free(str);
+    return reports;
+}
+
+static error_t
+parse_opt(int key, char *arg, struct argp_state *state)
+{
+    user_data_t *udata = state->input;
+
+    switch (key) {
+    case 'c':
+        udata->count = strtoul(arg, NULL, 10);
+        break;
+
+    case 'r':
+        udata->rate = strtoul(arg, NULL, 10);
+        break;
+
+    case 't':
+        udata->reports = parse_reports(arg);
+
+        if (udata->reports == 0) {
+            argp_error(state, "No valid report types in '%s'", arg);
+        }
+        break;
+
+    case 'v':
+        udata->verbose = 1;
+        break;
+
+    case ARGP_KEY_INIT:
+        udata->rate = 10;
+        udata->reports = REPORTS_ALL;
+        break;
+
+    case ARGP_KEY_ARG:
+        argp_usage(state);
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int tfd = -1;
+    int ret = EXIT_FAILURE;
+    struct pollfd pfds[2];
+    uint64_t expirations;
+    user_data_t udata;
+
+    static const struct argp_option options[] = {
+        {"count", 'c', "COUNT", 0, "Exit after injecting COUNT reports", 0},
+        {"rate", 'r', "RATE", 0, "Input reports injected per second (0 = none)", 0},
+        {"reports", 't', "LIST", 0, "Injected types: media,g,control,all", 0},
+        {"verbose", 'v', NULL, 0, "Verbosely print additional messages", 0},
+        {NULL}
+    };
+
+    static const struct argp argp = {
+        options,
+        parse_opt,
+        NULL,
+        "Creates a virtual G710+ via uhid which injects input reports",
+        NULL,
+        NULL,
+        NULL
+    };
+
+    memset(&udata, 0, sizeof udata);
+    argp_parse(&argp, argc, argv, 0, NULL, &udata);
+    udata.fd = open("/dev/uhid", O_RDWR | O_CLOEXEC | O_NONBLOCK);
+
+    if (udata.fd == -1) {
+        g710p_tools_errorln("Failed to open /dev/uhid: %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if (!uhid_create(udata.fd)) {
+        close(udata.fd);
+        return EXIT_FAILURE;
+    }
+
+    if (udata.rate > 0) {
+        tfd = timer_create_rate(udata.rate);
+
+        if (tfd == -1) {
+            g710p_tools_errorln("Failed to create timer: %s", strerror(errno));
+            goto cleanup;
+        }
+    }
+
+    signal(SIGINT, sighandler);
+    signal(SIGTERM, sighandler);
+
+    pfds[0].fd = udata.fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = tfd;
+    pfds[1].events = POLLIN;
+
+    while (!quit) {
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            g710p_tools_errorln("Failed to poll: %s", strerror(errno));
+            goto cleanup;
+        }
+
+        if ((pfds[0].revents & POLLIN) && !uhid_dispatch(&udata)) {
+            goto cleanup;
+        }
+
+        if (!(pfds[1].revents & POLLIN)) {
+            continue;
+        }
+
+        if (read(tfd, &expirations, sizeof expirations) != sizeof expirations) {
+            continue;
+        }
+
+        if (!inject_reports(&udata, expirations)) {
+            goto cleanup;
+        }
+    }
+
+    if (udata.verbose) {
+        g710p_tools_println("Injected %lu reports", udata.sent);
+    }
+
+    ret = EXIT_SUCCESS;
+
+cleanup:
+    if (tfd != -1) {
+        close(tfd);
+    }
+
+    uhid_destroy(udata.fd);
+    close(udata.fd);
+    return ret;
+}
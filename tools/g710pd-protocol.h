@@ -0,0 +1,84 @@
+/*
+ * Copyright 2016 James Geboski <jgeboski@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _G710PD_PROTOCOL_H_
+#define _G710PD_PROTOCOL_H_
+
+#include <stdint.h>
+
+/* The g710pd protocol is a stream of fixed size messages, sent over a
+ * SOCK_SEQPACKET Unix socket at $XDG_RUNTIME_DIR/g710pd.sock. Devices
+ * are indexed by the slot the daemon attached them to, which they keep
+ * until they are removed. The levels and LEDs requested for an empty
+ * slot are applied once a device is attached to it.
+ */
+
+#define G710PD_VERSION  2
+#define G710PD_SOCKET  "g710pd.sock"
+#define G710PD_DEVICES_MAX  16
+#define G710PD_DEVICE_ALL  0xFF
+
+/* Sent by the daemon once connected, and whenever a device is added or
+ * removed: device is the connected device count, data[0] is the
+ * protocol version, and data[1..2] is the little-endian mask of the
+ * connected device slots.
+ */
+#define G710PD_MSG_INFO  0x01
+
+/* Sent by the daemon for each report: data[0] is the report type,
+ * data[1] the media keys, data[2..3] the little-endian G keys, data[4]
+ * the keyboard level, and data[5] the WASD level.
+ */
+#define G710PD_MSG_REPORT  0x02
+
+/* Sent by the daemon for each key event: data[0] is the report type,
+ * data[1] is 1 if pressed, and data[2..3] is the little-endian key.
+ */
+#define G710PD_MSG_KEY  0x03
+
+/* Sent by a client to set its subscriptions: data[0] is the OR'd
+ * G710PD_SUB_* flags.
+ */
+#define G710PD_MSG_SUBSCRIBE  0x10
+
+/* Sent by a client to set the backlight levels: data[0] is the keyboard
+ * level, and data[1] is the WASD level. The latest levels are applied,
+ * and kept for a device attached later to the same slot.
+ */
+#define G710PD_MSG_LEVELS  0x11
+
+/* Sent by a client to set its M key LEDs: data[0] is the active keys.
+ * The LEDs of every client are OR'd together.
+ */
+#define G710PD_MSG_LEDS  0x12
+
+#define G710PD_SUB_REPORTS  (1 << 0)
+#define G710PD_SUB_KEYS  (1 << 1)
+
+
+typedef struct g710pd_msg g710pd_msg_t;
+
+
+struct g710pd_msg
+{
+    uint8_t type;
+    uint8_t device;
+    uint8_t data[6];
+};
+
+#endif /* _G710PD_PROTOCOL_H_ */
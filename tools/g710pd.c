@@ -0,0 +1,661 @@
+/*
+ * Copyright 2016 James Geboski <jgeboski@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+
+#include <argp.h>
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "g710p-tools-common.h"
+
+
+#define CLIENTS_MAX  64
+#define REPORTS_MAX  16
+#define WRITE_RATE  60
+
+/* The listening socket and the hotplug monitor precede the devices */
+#define PFD_DEVICES  2
+#define PFD_CLIENTS  (PFD_DEVICES + G710PD_DEVICES_MAX)
+
+
+typedef struct client client_t;
+typedef struct user_data user_data_t;
+
+
+struct client
+{
+    int fd;
+    int dead;
+    uint8_t subs;
+    uint8_t leds[G710PD_DEVICES_MAX];
+};
+
+struct user_data
+{
+    g710p_tools_device_t *devs[G710PD_DEVICES_MAX];
+    g710p_hotplug_t *hp;
+    uint8_t kb_levels[G710PD_DEVICES_MAX];
+    uint8_t wasd_levels[G710PD_DEVICES_MAX];
+    int levels_set[G710PD_DEVICES_MAX];
+    int daemonize;
+    int verbose;
+    char path[sizeof ((struct sockaddr_un *) NULL)->sun_path];
+    int fd;
+    client_t clients[CLIENTS_MAX];
+    unsigned int nclients;
+};
+
+
+const char *argp_program_version = PACKAGE_STRING;
+const char *argp_program_bug_address = PACKAGE_BUGREPORT;
+
+static int quit = 0;
+
+
+static void
+sighandler(int signal)
+{
+    quit = 1;
+}
+
+static void
+client_send(client_t *client, const g710pd_msg_t *msg)
+{
+    ssize_t res;
+
+    if (client->dead) {
+        return;
+    }
+
+    /* A client which falls behind is dropped, rather than stalling the
+     * other clients, as it would otherwise miss key releases.
+     */
+    res = send(client->fd, msg, sizeof *msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    if (res != sizeof *msg) {
+        client->dead = 1;
+    }
+}
+
+static void
+clients_broadcast(user_data_t *udata, uint8_t sub, const g710pd_msg_t *msg)
+{
+    unsigned int i;
+
+    for (i = 0; i < udata->nclients; i++) {
+        if (udata->clients[i].subs & sub) {
+            client_send(&udata->clients[i], msg);
+        }
+    }
+}
+
+static void
+info_get(user_data_t *udata, g710pd_msg_t *msg)
+{
+    unsigned int i;
+    uint16_t mask = 0;
+
+    memset(msg, 0, sizeof *msg);
+    msg->type = G710PD_MSG_INFO;
+    msg->data[0] = G710PD_VERSION;
+
+    for (i = 0; i < G710PD_DEVICES_MAX; i++) {
+        if (udata->devs[i] != NULL) {
+            mask |= 1 << i;
+            msg->device++;
+        }
+    }
+
+    msg->data[1] = mask & 0xFF;
+    msg->data[2] = mask >> 8;
+}
+
+static void
+info_broadcast(user_data_t *udata)
+{
+    g710pd_msg_t msg;
+    unsigned int i;
+
+    info_get(udata, &msg);
+
+    for (i = 0; i < udata->nclients; i++) {
+        client_send(&udata->clients[i], &msg);
+    }
+}
+
+static void
+leds_update(user_data_t *udata, unsigned int dev)
+{
+    unsigned int i;
+    uint8_t keys = 0;
+
+    if (udata->devs[dev] == NULL) {
+        return;
+    }
+
+    for (i = 0; i < udata->nclients; i++) {
+        if (!udata->clients[i].dead) {
+            keys |= udata->clients[i].leds[dev];
+        }
+    }
+
+    g710p_mkeys_post_leds(udata->devs[dev]->dev, keys);
+}
+
+static void
+levels_update(user_data_t *udata, unsigned int dev)
+{
+    if ((udata->devs[dev] == NULL) || !udata->levels_set[dev]) {
+        return;
+    }
+
+    g710p_backlight_post_levels(udata->devs[dev]->dev, udata->kb_levels[dev],
+                                udata->wasd_levels[dev]);
+}
+
+static int
+client_handle(user_data_t *udata, client_t *client, const g710pd_msg_t *msg)
+{
+    unsigned int first = msg->device;
+    unsigned int i;
+    unsigned int last = msg->device;
+
+    if (msg->device == G710PD_DEVICE_ALL) {
+        first = 0;
+        last = G710PD_DEVICES_MAX - 1;
+    } else if (msg->device >= G710PD_DEVICES_MAX) {
+        return 0;
+    }
+
+    switch (msg->type) {
+    case G710PD_MSG_SUBSCRIBE:
+        client->subs = msg->data[0];
+        return 1;
+
+    case G710PD_MSG_LEVELS:
+        if ((msg->data[0] > 4) || (msg->data[1] > 4)) {
+            return 0;
+        }
+
+        /* Kept for empty slots too, so a reattached device gets them */
+        for (i = first; i <= last; i++) {
+            udata->kb_levels[i] = msg->data[0];
+            udata->wasd_levels[i] = msg->data[1];
+            udata->levels_set[i] = 1;
+            levels_update(udata, i);
+        }
+        return 1;
+
+    case G710PD_MSG_LEDS:
+        /* Kept for empty slots too, so a reattached device gets them */
+        for (i = first; i <= last; i++) {
+            client->leds[i] = msg->data[0] & G710P_KEY_MASK_M;
+            leds_update(udata, i);
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+static void
+client_dispatch(user_data_t *udata, client_t *client)
+{
+    g710pd_msg_t msg;
+    ssize_t res;
+
+    while (!client->dead) {
+        res = recv(client->fd, &msg, sizeof msg, MSG_DONTWAIT);
+
+        if ((res < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+            break;
+        }
+
+        if ((res != sizeof msg) || !client_handle(udata, client, &msg)) {
+            client->dead = 1;
+        }
+    }
+}
+
+static void
+client_accept(user_data_t *udata)
+{
+    client_t *client;
+    g710pd_msg_t msg;
+    int fd;
+
+    fd = accept4(udata->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+
+    if (fd == -1) {
+        return;
+    }
+
+    if (udata->nclients >= CLIENTS_MAX) {
+        g710p_tools_errorln("Too many clients, refusing a client");
+        close(fd);
+        return;
+    }
+
+    client = &udata->clients[udata->nclients++];
+    memset(client, 0, sizeof *client);
+    client->fd = fd;
+    info_get(udata, &msg);
+    client_send(client, &msg);
+
+    if (udata->verbose) {
+        g710p_tools_println("Client %d connected", fd);
+    }
+}
+
+static void
+clients_sweep(user_data_t *udata)
+{
+    client_t *client;
+    int dropped = 0;
+    unsigned int i;
+    unsigned int j;
+
+    for (i = 0, j = 0; i < udata->nclients; i++) {
+        client = &udata->clients[i];
+
+        if (!client->dead) {
+            udata->clients[j++] = *client;
+            continue;
+        }
+
+        if (udata->verbose) {
+            g710p_tools_println("Client %d disconnected", client->fd);
+        }
+
+        close(client->fd);
+        dropped = 1;
+    }
+
+    udata->nclients = j;
+
+    /* Drop the LEDs of the disconnected clients */
+    for (i = 0; dropped && (i < G710PD_DEVICES_MAX); i++) {
+        leds_update(udata, i);
+    }
+}
+
+static void
+device_attach(user_data_t *udata, const char *path)
+{
+    g710p_tools_device_t *tdev;
+    unsigned int i;
+
+    for (i = 0; udata->devs[i] != NULL; i++) {
+        if (i == (G710PD_DEVICES_MAX - 1)) {
+            g710p_tools_errorln("Too many devices, ignoring %s", path);
+            return;
+        }
+    }
+
+    tdev = g710p_tools_device_open(path);
+
+    if (tdev == NULL) {
+        return;
+    }
+
+    if ((g710p_fd(tdev->dev) == -1) || !g710p_writer_start(tdev->dev)) {
+        g710p_tools_errorln("Failed to set up %s", path);
+        g710p_tools_device_close(tdev, 0);
+        return;
+    }
+
+    g710p_writer_set_rate(tdev->dev, WRITE_RATE);
+    udata->devs[i] = tdev;
+    levels_update(udata, i);
+    leds_update(udata, i);
+    info_broadcast(udata);
+
+    if (udata->verbose) {
+        g710p_tools_println("Attached %s as device %u", path, i);
+    }
+}
+
+static void
+device_detach(user_data_t *udata, unsigned int n)
+{
+    if (udata->verbose) {
+        g710p_tools_println("Detached %s from device %u",
+                            udata->devs[n]->path, n);
+    }
+
+    /* The device is gone, so there is nothing to restore */
+    g710p_tools_device_close(udata->devs[n], 0);
+    udata->devs[n] = NULL;
+    info_broadcast(udata);
+}
+
+static void
+hotplug_callback(const char *path, int added, void *data)
+{
+    unsigned int i;
+    user_data_t *udata = data;
+
+    if (added) {
+        device_attach(udata, path);
+        return;
+    }
+
+    for (i = 0; i < G710PD_DEVICES_MAX; i++) {
+        if ((udata->devs[i] != NULL) &&
+            (strcmp(udata->devs[i]->path, path) == 0))
+        {
+            device_detach(udata, i);
+            return;
+        }
+    }
+}
+
+static int
+device_dispatch(user_data_t *udata, unsigned int n)
+{
+    g710p_device_t *dev = udata->devs[n]->dev;
+    g710p_key_event_t events[G710P_KEY_EVENTS_MAX];
+    g710p_report_t reports[REPORTS_MAX];
+    g710pd_msg_t msg;
+    int i;
+    int res;
+    size_t count;
+    size_t j;
+    uint64_t time;
+
+    res = g710p_report_get_many(dev, reports, REPORTS_MAX, 0);
+    time = g710p_time_ns();
+    memset(&msg, 0, sizeof msg);
+    msg.device = n;
+
+    for (i = 0; i < res; i++) {
+        msg.type = G710PD_MSG_REPORT;
+        msg.data[0] = reports[i].type;
+        msg.data[1] = reports[i].media_keys;
+        msg.data[2] = reports[i].g_keys & 0xFF;
+        msg.data[3] = reports[i].g_keys >> 8;
+        msg.data[4] = reports[i].kb_level;
+        msg.data[5] = reports[i].wasd_level;
+        clients_broadcast(udata, G710PD_SUB_REPORTS, &msg);
+
+        count = g710p_report_events(dev, &reports[i], time, events);
+        msg.type = G710PD_MSG_KEY;
+        msg.data[4] = 0;
+        msg.data[5] = 0;
+
+        for (j = 0; j < count; j++) {
+            msg.data[0] = events[j].type;
+            msg.data[1] = events[j].pressed;
+            msg.data[2] = events[j].key & 0xFF;
+            msg.data[3] = events[j].key >> 8;
+            clients_broadcast(udata, G710PD_SUB_KEYS, &msg);
+        }
+    }
+
+    return res >= 0;
+}
+
+static int
+socket_listen(user_data_t *udata)
+{
+    int fd;
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, udata->path);
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+
+    if (fd == -1) {
+        g710p_tools_errorln("Failed to create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    /* Only replace the socket of a daemon which is no longer running */
+    if (connect(fd, (struct sockaddr *) &addr, sizeof addr) == 0) {
+        g710p_tools_errorln("Another daemon is listening on %s", udata->path);
+        close(fd);
+        return -1;
+    }
+
+    unlink(udata->path);
+
+    if ((bind(fd, (struct sockaddr *) &addr, sizeof addr) != 0) ||
+        (listen(fd, CLIENTS_MAX) != 0))
+    {
+        g710p_tools_errorln("Failed to listen on %s: %s", udata->path,
+                            strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static error_t
+parse_opt(int key, char *arg, struct argp_state *state)
+{
+    user_data_t *udata = state->input;
+
+    switch (key) {
+    case 'd':
+        udata->daemonize = 1;
+        break;
+
+    case 's':
+        if (strlen(arg) >= sizeof udata->path) {
+            argp_error(state, "Socket path too long: %s", arg);
+        }
+
+        strcpy(udata->path, arg);
+        break;
+
+    case 'v':
+        udata->verbose = 1;
+        break;
+
+    case ARGP_KEY_INIT:
+        g710p_tools_socket_path(udata->path, sizeof udata->path);
+        break;
+
+    case ARGP_KEY_END:
+        if (udata->daemonize && udata->verbose) {
+            udata->verbose = 0;
+        }
+        break;
+
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    char **devlist = NULL;
+    char **paths;
+    int ret = EXIT_FAILURE;
+    struct pollfd pfds[PFD_CLIENTS + CLIENTS_MAX];
+    unsigned int i;
+    unsigned int n;
+    user_data_t udata;
+
+    static const struct argp_option options[] = {
+        {"daemonize", 'd', NULL, 0, "Fork the process to the background", 0},
+        {"socket", 's', "PATH", 0, "Path of the listening socket", 0},
+        {"verbose", 'v', NULL, 0, "Verbosely print additional messages", 0},
+        {NULL}
+    };
+
+    static const struct argp argp = {
+        options,
+        parse_opt,
+        NULL,
+        "Serves the G710+ keyboards to clients over a Unix socket",
+        NULL,
+        NULL,
+        NULL
+    };
+
+    memset(&udata, 0, sizeof udata);
+    udata.fd = -1;
+    argp_parse(&argp, argc, argv, 0, NULL, &udata);
+
+    if (!g710p_init()) {
+        g710p_tools_errorln("Failed to initialize libg710p");
+        return EXIT_FAILURE;
+    }
+
+    udata.fd = socket_listen(&udata);
+
+    if (udata.fd == -1) {
+        goto cleanup;
+    }
+
+    /* Without hotplug, the devices present now are all there will be */
+    udata.hp = g710p_hotplug_new(hotplug_callback, &udata);
+
+    if (udata.hp != NULL) {
+        paths = g710p_hotplug_devices(udata.hp);
+    } else {
+        devlist = g710p_device_list_get();
+        paths = devlist;
+
+        if (devlist[0] == NULL) {
+            g710p_tools_errorln("Failed to find any supported devices");
+            goto cleanup;
+        }
+    }
+
+    if (udata.daemonize && !g710p_tools_daemonize()) {
+        g710p_tools_errorln("Failed to daemonize");
+        goto cleanup;
+    }
+
+    /* Attach after forking, as the writer threads do not survive it */
+    for (i = 0; paths[i] != NULL; i++) {
+        device_attach(&udata, paths[i]);
+    }
+
+    signal(SIGINT, sighandler);
+    signal(SIGTERM, sighandler);
+
+    while (!quit) {
+        pfds[0].fd = udata.fd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = (udata.hp != NULL) ? g710p_hotplug_fd(udata.hp) : -1;
+        pfds[1].events = POLLIN;
+
+        /* Empty slots have a negative descriptor, which poll() ignores */
+        for (i = 0; i < G710PD_DEVICES_MAX; i++) {
+            n = PFD_DEVICES + i;
+            pfds[n].fd = -1;
+            pfds[n].events = POLLIN;
+
+            if (udata.devs[i] != NULL) {
+                pfds[n].fd = g710p_fd(udata.devs[i]->dev);
+            }
+        }
+
+        for (i = 0, n = PFD_CLIENTS; i < udata.nclients; i++, n++) {
+            pfds[n].fd = udata.clients[i].fd;
+            pfds[n].events = POLLIN;
+        }
+
+        if (poll(pfds, n, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            g710p_tools_errorln("Failed to poll: %s", strerror(errno));
+            goto cleanup;
+        }
+
+        /* A lost device is dropped alone, and reattached by hotplug */
+        for (i = 0; i < G710PD_DEVICES_MAX; i++) {
+            n = PFD_DEVICES + i;
+
+            if ((pfds[n].revents & (POLLERR | POLLHUP)) ||
+                ((pfds[n].revents & POLLIN) && !device_dispatch(&udata, i)))
+            {
+                g710p_tools_errorln("Lost device %u", i);
+                device_detach(&udata, i);
+            }
+        }
+
+        for (i = 0, n = PFD_CLIENTS; i < udata.nclients; i++, n++) {
+            if (pfds[n].revents & POLLIN) {
+                client_dispatch(&udata, &udata.clients[i]);
+            } else if (pfds[n].revents & (POLLERR | POLLHUP)) {
+                udata.clients[i].dead = 1;
+            }
+        }
+
+        if (pfds[1].revents & POLLIN) {
+            g710p_hotplug_dispatch(udata.hp, 0);
+        }
+
+        /* Accept after the clients, as the indexes of the poll match */
+        if (pfds[0].revents & POLLIN) {
+            client_accept(&udata);
+        }
+
+        clients_sweep(&udata);
+    }
+
+    ret = EXIT_SUCCESS;
+
+cleanup:
+    for (i = 0; i < udata.nclients; i++) {
+        close(udata.clients[i].fd);
+    }
+
+    if (udata.fd != -1) {
+        close(udata.fd);
+        unlink(udata.path);
+    }
+
+    for (i = 0; i < G710PD_DEVICES_MAX; i++) {
+        if (udata.devs[i] != NULL) {
+            g710p_tools_device_close(udata.devs[i], 1);
+        }
+    }
+
+    if (udata.hp != NULL) {
+        g710p_hotplug_free(udata.hp);
+    }
+
+    if (devlist != NULL) {
+        g710p_device_list_free(devlist);
+    }
+
+    if (!g710p_exit()) {
+        g710p_tools_errorln("Failed to exit libg710p");
+    }
+
+    return ret;
+}